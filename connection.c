@@ -8,6 +8,8 @@
  */
 
 #include <linux/workqueue.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #include "greybus.h"
 
@@ -61,10 +63,59 @@ void greybus_data_rcvd(struct gb_host_device *hd, u16 cport_id,
 			"nonexistent connection (%zu bytes dropped)\n", length);
 		return;
 	}
-	gb_connection_recv(connection, data, length);
+	gb_connection_recv(connection, data, length, NULL);
 }
 EXPORT_SYMBOL_GPL(greybus_data_rcvd);
 
+/*
+ * Like greybus_data_rcvd(), but the host driver offers to lend the buffer
+ * holding the data (identified by a non-null cookie) instead of having
+ * it copied.
+ *
+ * Returns true if the buffer was taken, in which case the host driver
+ * must not reuse it until it is handed back through the driver's
+ * rx_buffer_release callback (which may happen in atomic context, and
+ * before this function returns).  Returns false if the data has been
+ * copied or dropped, and the buffer can be reused right away.
+ */
+bool greybus_data_rcvd_buffer(struct gb_host_device *hd, u16 cport_id,
+				u8 *data, size_t length, void *cookie)
+{
+	struct gb_connection *connection;
+
+	if (WARN_ON_ONCE(!hd->driver->rx_buffer_release || !cookie)) {
+		greybus_data_rcvd(hd, cport_id, data, length);
+		return false;
+	}
+
+	connection = gb_connection_hd_find(hd, cport_id);
+	if (!connection) {
+		dev_err(&hd->dev,
+			"nonexistent connection (%zu bytes dropped)\n", length);
+		return false;
+	}
+
+	return gb_connection_recv(connection, data, length, cookie);
+}
+EXPORT_SYMBOL_GPL(greybus_data_rcvd_buffer);
+
+/*
+ * Let the host driver know whether the messages received on a cport may be
+ * delivered out of order, which is only the case if the protocol of its
+ * connection handles its requests independently of each other.
+ */
+bool greybus_cport_unordered(struct gb_host_device *hd, u16 cport_id)
+{
+	struct gb_connection *connection;
+
+	connection = gb_connection_hd_find(hd, cport_id);
+	if (!connection || !connection->protocol)
+		return false;
+
+	return connection->protocol->ordering == GB_PROTOCOL_UNORDERED;
+}
+EXPORT_SYMBOL_GPL(greybus_cport_unordered);
+
 static DEFINE_MUTEX(connection_mutex);
 
 static void gb_connection_kref_release(struct kref *kref)
@@ -77,6 +128,193 @@ static void gb_connection_kref_release(struct kref *kref)
 	mutex_unlock(&connection_mutex);
 }
 
+/*
+ * CPU to handle the connection's operation completions on, or -1 to handle
+ * them on the CPU that received the response.
+ */
+static int gb_connection_completion_cpu_get(void *data, u64 *val)
+{
+	struct gb_connection *connection = data;
+
+	*val = (s64)READ_ONCE(connection->completion_cpu);
+
+	return 0;
+}
+
+static int gb_connection_completion_cpu_set(void *data, u64 val)
+{
+	struct gb_connection *connection = data;
+	s64 cpu = (s64)val;
+
+	if (cpu != -1 && (cpu < 0 || cpu >= nr_cpu_ids || !cpu_possible(cpu)))
+		return -EINVAL;
+
+	WRITE_ONCE(connection->completion_cpu, (int)cpu);
+
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(gb_connection_completion_cpu_fops,
+			gb_connection_completion_cpu_get,
+			gb_connection_completion_cpu_set, "%lld\n");
+
+static int gb_connection_sync_stats_show(struct seq_file *s, void *unused)
+{
+	struct gb_connection *connection = s->private;
+
+	seq_printf(s, "rtt_us: %u\n",
+			READ_ONCE(connection->sync_rtt.srtt_us));
+	seq_printf(s, "rttvar_us: %u\n",
+			READ_ONCE(connection->sync_rtt.rttvar_us));
+	seq_printf(s, "spins: %d\n", atomic_read(&connection->sync_spins));
+	seq_printf(s, "spin_hits: %d\n",
+			atomic_read(&connection->sync_spin_hits));
+
+	return 0;
+}
+
+static int gb_connection_sync_stats_open(struct inode *inode,
+						struct file *file)
+{
+	return single_open(file, gb_connection_sync_stats_show,
+				inode->i_private);
+}
+
+static const struct file_operations gb_connection_sync_stats_fops = {
+	.open		= gb_connection_sync_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int gb_connection_rtt_show(struct seq_file *s, void *unused)
+{
+	struct gb_connection *connection = s->private;
+	struct gb_connection_rtt *rtt;
+	u32 samples;
+	int type;
+
+	seq_puts(s, "type\tsamples\tsrtt_us\trttvar_us\ttimeout_ms\n");
+	for (type = 0; type < GB_CONNECTION_RTT_TYPES; type++) {
+		rtt = &connection->rtt[type];
+		samples = READ_ONCE(rtt->samples);
+		if (!samples)
+			continue;
+
+		seq_printf(s, "0x%02x\t%u\t%u\t%u\t%u\n", type, samples,
+				READ_ONCE(rtt->srtt_us),
+				READ_ONCE(rtt->rttvar_us),
+				gb_connection_rtt_timeout(connection, type));
+	}
+
+	return 0;
+}
+
+static int gb_connection_rtt_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, gb_connection_rtt_show, inode->i_private);
+}
+
+static const struct file_operations gb_connection_rtt_fops = {
+	.open		= gb_connection_rtt_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int gb_connection_window_get(void *data, u64 *val)
+{
+	struct gb_connection *connection = data;
+
+	*val = connection->window;
+
+	return 0;
+}
+
+static int gb_connection_window_debugfs_set(void *data, u64 val)
+{
+	struct gb_connection *connection = data;
+
+	if (val > UINT_MAX)
+		return -EINVAL;
+
+	return gb_connection_window_set(connection, val,
+					connection->window_policy);
+}
+DEFINE_SIMPLE_ATTRIBUTE(gb_connection_window_fops,
+			gb_connection_window_get,
+			gb_connection_window_debugfs_set, "%llu\n");
+
+static int gb_connection_window_policy_get(void *data, u64 *val)
+{
+	struct gb_connection *connection = data;
+
+	*val = connection->window_policy;
+
+	return 0;
+}
+
+static int gb_connection_window_policy_set(void *data, u64 val)
+{
+	struct gb_connection *connection = data;
+
+	return gb_connection_window_set(connection, connection->window, val);
+}
+DEFINE_SIMPLE_ATTRIBUTE(gb_connection_window_policy_fops,
+			gb_connection_window_policy_get,
+			gb_connection_window_policy_set, "%llu\n");
+
+static int gb_connection_priority_get(void *data, u64 *val)
+{
+	struct gb_connection *connection = data;
+
+	*val = connection->priority;
+
+	return 0;
+}
+
+static int gb_connection_priority_set(void *data, u64 val)
+{
+	struct gb_connection *connection = data;
+
+	if (val >= GB_OPERATION_PRIORITY_COUNT)
+		return -EINVAL;
+
+	WRITE_ONCE(connection->priority, val);
+
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(gb_connection_priority_fops,
+			gb_connection_priority_get,
+			gb_connection_priority_set, "%llu\n");
+
+static int gb_connection_window_stats_show(struct seq_file *s, void *unused)
+{
+	struct gb_connection *connection = s->private;
+
+	spin_lock_irq(&connection->lock);
+	seq_printf(s, "used: %u\n", connection->window_used);
+	seq_printf(s, "used_max: %u\n", connection->window_used_max);
+	seq_printf(s, "queued: %u\n", connection->window_queued);
+	seq_printf(s, "stalls: %llu\n", connection->window_stalls);
+	spin_unlock_irq(&connection->lock);
+
+	return 0;
+}
+
+static int gb_connection_window_stats_open(struct inode *inode,
+						struct file *file)
+{
+	return single_open(file, gb_connection_window_stats_show,
+				inode->i_private);
+}
+
+static const struct file_operations gb_connection_window_stats_fops = {
+	.open		= gb_connection_window_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 static void gb_connection_init_name(struct gb_connection *connection)
 {
 	u16 hd_cport_id = connection->hd_cport_id;
@@ -119,9 +357,11 @@ gb_connection_create(struct gb_host_device *hd, int hd_cport_id,
 	struct gb_connection *connection;
 	struct ida *id_map = &hd->cport_id_map;
 	int ida_start, ida_end;
+	char name[16];
 	int retval;
 	u8 major = 0;
 	u8 minor = 1;
+	int i;
 
 	/*
 	 * If a manifest tries to reuse a cport, reject it.  We
@@ -164,20 +404,89 @@ gb_connection_create(struct gb_host_device *hd, int hd_cport_id,
 
 	connection->bundle = bundle;
 	connection->state = GB_CONNECTION_STATE_DISABLED;
+	connection->priority = GB_OPERATION_PRIORITY_NORMAL;
 
 	atomic_set(&connection->op_cycle, 0);
 	spin_lock_init(&connection->lock);
 	INIT_LIST_HEAD(&connection->operations);
+	init_waitqueue_head(&connection->cancel_wq);
+	hash_init(connection->outgoing_operations);
+	for (i = 0; i < GB_OPERATION_PRIORITY_COUNT; i++)
+		INIT_LIST_HEAD(&connection->window_queue[i]);
+	init_waitqueue_head(&connection->window_wq);
+	INIT_WORK(&connection->window_work, gb_operation_window_work);
 
-	connection->wq = alloc_workqueue("%s:%d", WQ_UNBOUND, 1,
+	/*
+	 * Ordering of incoming requests is kept by their lanes, whose work
+	 * items never run concurrently with themselves, so the workqueue
+	 * itself doesn't need to be ordered.
+	 */
+	connection->wq = alloc_workqueue("%s:%d", WQ_UNBOUND, 0,
 					 dev_name(&hd->dev), hd_cport_id);
 	if (!connection->wq)
 		goto err_free_connection;
 
+	for (i = 0; i < GB_CONNECTION_INCOMING_LANES; i++) {
+		connection->incoming[i].connection = connection;
+		init_llist_head(&connection->incoming[i].list);
+		connection->incoming[i].pending = NULL;
+		INIT_WORK(&connection->incoming[i].work,
+				gb_operation_incoming_work);
+	}
+	connection->incoming_budget = GB_CONNECTION_INCOMING_BUDGET;
+
 	kref_init(&connection->kref);
 
 	gb_connection_init_name(connection);
 
+	snprintf(name, sizeof(name), "cport%d", hd_cport_id);
+	connection->debugfs_dentry = debugfs_create_dir(name,
+							hd->debugfs_dentry);
+
+	connection->completion_cpu = -1;
+	debugfs_create_file("completion_cpu", S_IRUGO | S_IWUSR,
+				connection->debugfs_dentry, connection,
+				&gb_connection_completion_cpu_fops);
+
+	/* Busy-waiting for synchronous operations is disabled by default */
+	atomic_set(&connection->sync_spins, 0);
+	atomic_set(&connection->sync_spin_hits, 0);
+	debugfs_create_u32("sync_spin_max_us", S_IRUGO | S_IWUSR,
+				connection->debugfs_dentry,
+				&connection->sync_spin_max_us);
+	debugfs_create_file("sync_stats", S_IRUGO, connection->debugfs_dentry,
+				connection, &gb_connection_sync_stats_fops);
+
+	/* The in-flight window is unlimited by default */
+	debugfs_create_file("window", S_IRUGO | S_IWUSR,
+				connection->debugfs_dentry, connection,
+				&gb_connection_window_fops);
+	debugfs_create_file("window_policy", S_IRUGO | S_IWUSR,
+				connection->debugfs_dentry, connection,
+				&gb_connection_window_policy_fops);
+	debugfs_create_file("window_stats", S_IRUGO,
+				connection->debugfs_dentry, connection,
+				&gb_connection_window_stats_fops);
+	debugfs_create_file("priority", S_IRUGO | S_IWUSR,
+				connection->debugfs_dentry, connection,
+				&gb_connection_priority_fops);
+
+	/* Zero means no limit */
+	debugfs_create_u32("incoming_budget", S_IRUGO | S_IWUSR,
+				connection->debugfs_dentry,
+				&connection->incoming_budget);
+
+	connection->timeout_floor_ms = GB_OPERATION_TIMEOUT_FLOOR;
+	connection->timeout_ceiling_ms = GB_OPERATION_TIMEOUT_CEILING;
+	debugfs_create_u32("timeout_floor_ms", S_IRUGO | S_IWUSR,
+				connection->debugfs_dentry,
+				&connection->timeout_floor_ms);
+	debugfs_create_u32("timeout_ceiling_ms", S_IRUGO | S_IWUSR,
+				connection->debugfs_dentry,
+				&connection->timeout_ceiling_ms);
+	debugfs_create_file("rtt", S_IRUGO, connection->debugfs_dentry,
+				connection, &gb_connection_rtt_fops);
+
 	spin_lock_irq(&gb_connections_lock);
 	list_add(&connection->hd_links, &hd->connections);
 
@@ -251,35 +560,6 @@ static void gb_connection_hd_cport_disable(struct gb_connection *connection)
 	hd->driver->cport_disable(hd, connection->hd_cport_id);
 }
 
-/*
- * Cancel all active operations on a connection.
- *
- * Should only be called during connection tear down.
- */
-static void gb_connection_cancel_operations(struct gb_connection *connection,
-						int errno)
-{
-	struct gb_operation *operation;
-
-	spin_lock_irq(&connection->lock);
-	while (!list_empty(&connection->operations)) {
-		operation = list_last_entry(&connection->operations,
-						struct gb_operation, links);
-		gb_operation_get(operation);
-		spin_unlock_irq(&connection->lock);
-
-		if (gb_operation_is_incoming(operation))
-			gb_operation_cancel_incoming(operation, errno);
-		else
-			gb_operation_cancel(operation, errno);
-
-		gb_operation_put(operation);
-
-		spin_lock_irq(&connection->lock);
-	}
-	spin_unlock_irq(&connection->lock);
-}
-
 /*
  * Request the SVC to create a connection from AP's cport to interface's
  * cport.
@@ -427,6 +707,8 @@ err_disconnect:
 	connection->state = GB_CONNECTION_STATE_ERROR;
 	spin_unlock_irq(&connection->lock);
 
+	gb_operation_pool_destroy(connection);
+
 	gb_connection_control_disconnected(connection);
 err_svc_destroy:
 	gb_connection_svc_connection_destroy(connection);
@@ -438,9 +720,13 @@ err_hd_cport_disable:
 
 static void gb_connection_exit(struct gb_connection *connection)
 {
+	ktime_t start;
+
 	if (!connection->protocol)
 		return;
 
+	start = ktime_get();
+
 	spin_lock_irq(&connection->lock);
 	if (connection->state != GB_CONNECTION_STATE_ENABLED) {
 		spin_unlock_irq(&connection->lock);
@@ -449,12 +735,17 @@ static void gb_connection_exit(struct gb_connection *connection)
 	connection->state = GB_CONNECTION_STATE_DESTROYING;
 	spin_unlock_irq(&connection->lock);
 
-	gb_connection_cancel_operations(connection, -ESHUTDOWN);
+	gb_operation_cancel_all(connection, -ESHUTDOWN);
+	cancel_work_sync(&connection->window_work);
 
 	connection->protocol->connection_exit(connection);
+	gb_operation_pool_destroy(connection);
 	gb_connection_control_disconnected(connection);
 	gb_connection_svc_connection_destroy(connection);
 	gb_connection_hd_cport_disable(connection);
+
+	gb_hd_latency_add(&connection->hd->teardown,
+			ktime_us_delta(ktime_get(), start));
 }
 
 /*
@@ -478,6 +769,8 @@ void gb_connection_destroy(struct gb_connection *connection)
 		gb_protocol_put(connection->protocol);
 	connection->protocol = NULL;
 
+	debugfs_remove_recursive(connection->debugfs_dentry);
+
 	id_map = &connection->hd->cport_id_map;
 	ida_simple_remove(id_map, connection->hd_cport_id);
 	connection->hd_cport_id = CPORT_ID_BAD;
@@ -486,6 +779,74 @@ void gb_connection_destroy(struct gb_connection *connection)
 		       &connection_mutex);
 }
 
+/**
+ * gb_connection_rtt_timeout() - adaptive timeout of a type of operations
+ * @connection:	the connection the operations are sent over
+ * @type:	the operation type
+ *
+ * Derive a timeout from the round-trip times observed for operations of the
+ * given type as TCP does: the smoothed round-trip time plus four times its
+ * mean deviation.  The result is kept within the connection's floor and
+ * ceiling, and is the ceiling until a round trip has been measured.
+ *
+ * Return: The timeout in milliseconds.
+ */
+unsigned int gb_connection_rtt_timeout(struct gb_connection *connection,
+					u8 type)
+{
+	struct gb_connection_rtt *rtt;
+	u32 floor = READ_ONCE(connection->timeout_floor_ms);
+	u32 ceiling = READ_ONCE(connection->timeout_ceiling_ms);
+	u64 timeout;
+	u32 srtt;
+
+	rtt = &connection->rtt[type % GB_CONNECTION_RTT_TYPES];
+	srtt = READ_ONCE(rtt->srtt_us);
+	if (!srtt)
+		return max(ceiling, floor);
+
+	timeout = (u64)srtt + 4 * (u64)READ_ONCE(rtt->rttvar_us);
+	timeout = DIV_ROUND_UP_ULL(timeout, USEC_PER_MSEC);
+
+	return max_t(u64, min_t(u64, timeout, ceiling), floor);
+}
+EXPORT_SYMBOL_GPL(gb_connection_rtt_timeout);
+
+/**
+ * gb_connection_window_set() - limit the requests in flight on a connection
+ * @connection:	the connection
+ * @window:	maximum number of requests awaiting a response, or 0 for no
+ *		limit
+ * @policy:	what to do with requests sent while the window is full
+ *
+ * Return: 0 on success, or -EINVAL if the policy is invalid.
+ */
+int gb_connection_window_set(struct gb_connection *connection,
+				unsigned int window,
+				enum gb_connection_window_policy policy)
+{
+	switch (policy) {
+	case GB_CONNECTION_WINDOW_BLOCK:
+	case GB_CONNECTION_WINDOW_EAGAIN:
+	case GB_CONNECTION_WINDOW_QUEUE:
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	spin_lock_irq(&connection->lock);
+	connection->window = window;
+	connection->window_policy = policy;
+	spin_unlock_irq(&connection->lock);
+
+	/* Room may have been made for waiting or queued requests */
+	wake_up(&connection->window_wq);
+	queue_work(connection->hd->completion_wq, &connection->window_work);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(gb_connection_window_set);
+
 void gb_connection_latency_tag_enable(struct gb_connection *connection)
 {
 	struct gb_host_device *hd = connection->hd;
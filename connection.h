@@ -11,7 +11,51 @@
 #define __CONNECTION_H
 
 #include <linux/list.h>
+#include <linux/llist.h>
 #include <linux/kfifo.h>
+#include <linux/hashtable.h>
+
+/* Outgoing operations are looked up by id in a table of 2^n buckets */
+#define GB_CONNECTION_OP_HASH_BITS	8
+
+/* Default number of incoming requests handled per run of an incoming lane */
+#define GB_CONNECTION_INCOMING_BUDGET	16
+
+/* Number of lanes requests of a protocol ordered per type are spread over */
+#define GB_CONNECTION_INCOMING_LANES	4
+
+/* Round-trip times are tracked per request type (the response bit aside) */
+#define GB_CONNECTION_RTT_TYPES		128
+
+/* Smoothed round-trip time and mean deviation of a type of operations */
+struct gb_connection_rtt {
+	u32	srtt_us;	/* zero until the first sample */
+	u32	rttvar_us;
+	u32	samples;
+};
+
+/*
+ * A lane of incoming requests handled in order.  Requests are queued on a
+ * lockless list in reverse order of arrival, and handled in order by the
+ * lane's work, which keeps those it did not get to within its budget on
+ * pending.
+ */
+struct gb_connection_incoming {
+	struct gb_connection	*connection;
+	struct llist_head	list;
+	struct llist_node	*pending;
+	struct work_struct	work;
+};
+
+/*
+ * What to do with an outgoing request when the connection's window of
+ * in-flight requests is full.
+ */
+enum gb_connection_window_policy {
+	GB_CONNECTION_WINDOW_BLOCK	= 0,	/* wait for room if allowed */
+	GB_CONNECTION_WINDOW_EAGAIN	= 1,	/* fail with -EAGAIN */
+	GB_CONNECTION_WINDOW_QUEUE	= 2,	/* send once there is room */
+};
 
 enum gb_connection_state {
 	GB_CONNECTION_STATE_INVALID	= 0,
@@ -42,12 +86,47 @@ struct gb_connection {
 	spinlock_t			lock;
 	enum gb_connection_state	state;
 	struct list_head		operations;
+	wait_queue_head_t		cancel_wq;
+	DECLARE_HASHTABLE(outgoing_operations, GB_CONNECTION_OP_HASH_BITS);
+	struct gb_operation_pool	*op_pool;
+	u8				priority;	/* of its operations */
+
+	/* Window of in-flight requests, unlimited if zero */
+	unsigned int			window;
+	enum gb_connection_window_policy window_policy;
+	unsigned int			window_used;
+	unsigned int			window_used_max;
+	unsigned int			window_queued;
+	u64				window_stalls;
+	struct list_head		window_queue[GB_OPERATION_PRIORITY_COUNT];
+	wait_queue_head_t		window_wq;
+	struct work_struct		window_work;
 
 	char				name[16];
 	struct workqueue_struct		*wq;
 
+	/*
+	 * Ordered incoming requests all go through the first lane, while
+	 * those of protocols ordered per type are hashed by type.
+	 */
+	struct gb_connection_incoming	incoming[GB_CONNECTION_INCOMING_LANES];
+	u32				incoming_budget;
+	int				completion_cpu;
+
+	u32				sync_spin_max_us;
+	struct gb_connection_rtt	sync_rtt;
+	atomic_t			sync_spins;
+	atomic_t			sync_spin_hits;
+
 	atomic_t			op_cycle;
 
+	/* Bounds of adaptive timeouts, and the estimates they come from */
+	u32				timeout_floor_ms;
+	u32				timeout_ceiling_ms;
+	struct gb_connection_rtt	rtt[GB_CONNECTION_RTT_TYPES];
+
+	struct dentry			*debugfs_dentry;
+
 	void				*private;
 };
 
@@ -65,8 +144,17 @@ static inline bool gb_connection_is_static(struct gb_connection *connection)
 
 void greybus_data_rcvd(struct gb_host_device *hd, u16 cport_id,
 			u8 *data, size_t length);
+bool greybus_data_rcvd_buffer(struct gb_host_device *hd, u16 cport_id,
+				u8 *data, size_t length, void *cookie);
+bool greybus_cport_unordered(struct gb_host_device *hd, u16 cport_id);
 
 int gb_connection_bind_protocol(struct gb_connection *connection);
+int gb_connection_window_set(struct gb_connection *connection,
+				unsigned int window,
+				enum gb_connection_window_policy policy);
+
+unsigned int gb_connection_rtt_timeout(struct gb_connection *connection,
+					u8 type);
 
 void gb_connection_latency_tag_enable(struct gb_connection *connection);
 void gb_connection_latency_tag_disable(struct gb_connection *connection);
@@ -6,11 +6,14 @@
  *
  * Released under the GPLv2 only.
  */
+#include <linux/hrtimer.h>
 #include <linux/kthread.h>
 #include <linux/sizes.h>
 #include <linux/usb.h>
 #include <linux/kfifo.h>
+#include <linux/rcupdate.h>
 #include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include <asm/unaligned.h>
 
 #include "greybus.h"
@@ -21,6 +24,13 @@
 /* Memory sizes for the buffers sent to/from the ES2 controller */
 #define ES2_GBUF_MSG_SIZE_MAX	2048
 
+/*
+ * Small messages may be sent back to back in a single transfer of up to
+ * ES2_GBUF_MSG_SIZE_MAX bytes, see es2_agg_queue().
+ */
+#define ES2_AGG_MSG_SIZE_MAX	(ES2_GBUF_MSG_SIZE_MAX / 8)
+#define ES2_AGG_MSG_MAX		16
+
 static const struct usb_device_id id_table[] = {
 	{ USB_DEVICE(0x18d1, 0x1eaf) },
 	{ },
@@ -33,11 +43,57 @@ MODULE_DEVICE_TABLE(usb, id_table);
 #define NUM_BULKS		7
 
 /*
- * Number of CPort IN urbs in flight at any point in time.
- * Adjust if we are having stalls in the USB buffer due to not enough urbs in
- * flight.
+ * Default number of CPort IN urbs in flight per bulk endpoint at any point
+ * in time.  Adjust (through the cport_in_urbs parameter or debugfs file) if
+ * we are having stalls in the USB buffer due to not enough urbs in flight,
+ * which show up as ring-empty events, or let the urbs be scaled to the
+ * load.
  */
 #define NUM_CPORT_IN_URB	4
+#define ES2_CPORT_IN_URB_MAX	32
+
+static unsigned int cport_in_urbs = NUM_CPORT_IN_URB;
+module_param(cport_in_urbs, uint, 0444);
+
+/* Size of the CPort IN buffers, which may take several messages */
+#define ES2_CPORT_IN_SIZE_MAX	(32 * ES2_GBUF_MSG_SIZE_MAX)
+
+static unsigned int cport_in_size = ES2_GBUF_MSG_SIZE_MAX;
+module_param(cport_in_size, uint, 0444);
+
+static bool cport_in_autoscale;
+module_param(cport_in_autoscale, bool, 0444);
+
+/* Interval at which CPort IN urbs are scaled to the load */
+#define ES2_CPORT_IN_SCALE_INTERVAL	msecs_to_jiffies(1000)
+
+/*
+ * Received transfers can be processed by a poller per endpoint instead of
+ * in urb completion, which then only hands the urb over.  The poller
+ * handles up to a budget of messages before yielding the CPU, and runs on
+ * the CPU given, or with a negative value, on a CPU of its own per
+ * endpoint as far as there are.
+ */
+#define ES2_RX_POLL_BUDGET	64
+
+static bool rx_poll;
+module_param(rx_poll, bool, 0444);
+
+static int rx_poll_cpu = -1;
+module_param(rx_poll_cpu, int, 0444);
+
+/*
+ * Default smoothed number of bytes per balancing interval a CPort needs to
+ * carry to be given an endpoint pair of its own.
+ */
+#define ES2_EP_BALANCE_MIN_BYTES	(64 * 1024)
+
+/*
+ * Number of spare CPort IN buffers per bulk endpoint.  When one is
+ * available, a received request is handed to the greybus core in the urb's
+ * buffer, and the urb is resubmitted with a spare one instead.
+ */
+#define NUM_CPORT_IN_SPARE_BUF	NUM_CPORT_IN_URB
 
 /* Number of CPort OUT urbs in flight at any point in time.
  * Adjust if we get messages saying we are out of urbs in the system log.
@@ -60,22 +116,131 @@ MODULE_DEVICE_TABLE(usb, id_table);
 #define REQUEST_LATENCY_TAG_EN	0x06
 #define REQUEST_LATENCY_TAG_DIS	0x07
 
+struct es2_ap_dev;
+
+/*
+ * @bytes: number of bytes sent and received on the CPort
+ * @last_bytes: @bytes at the last balancing run
+ * @rate: smoothed number of bytes per balancing interval
+ * @out_pending: number of messages sent and not completed yet
+ * @enabled: whether the CPort is in use
+ * @unordered: whether the messages of the CPort may be reordered, and the
+ *		CPort thus be moved to another endpoint pair
+ */
+struct es2_cport {
+	atomic64_t bytes;
+	u64 last_bytes;
+	u64 rate;
+	atomic_t out_pending;
+	bool enabled;
+	bool unordered;
+};
+
 /*
  * @endpoint: bulk in endpoint for CPort data
+ * @es2: the device the endpoint belongs to
  * @urb: array of urbs for the CPort in messages
- * @buffer: array of buffers for the @cport_in_urb urbs
+ * @urb_count: number of urbs in @urb
+ * @in_flight: number of urbs submitted and not completed yet
+ * @completions: number of urbs completed
+ * @ring_empty: number of urbs completed while no other urb was submitted,
+ *	leaving the host controller with no buffer to receive into
+ * @scale_completions: @completions when the urbs were last scaled
+ * @scale_ring_empty: @ring_empty when the urbs were last scaled
+ * @rx_list: urbs completed and waiting for the poller, linked through
+ *	their urb_list
+ * @rx_lock: locks @rx_list
+ * @rx_mutex: held by the poller while it owns urbs taken off @rx_list
+ * @rx_work: the poller
+ * @rx_cpu: CPU the poller runs on, or negative for any
  */
 struct es2_cport_in {
 	__u8 endpoint;
-	struct urb *urb[NUM_CPORT_IN_URB];
-	u8 *buffer[NUM_CPORT_IN_URB];
+	struct es2_ap_dev *es2;
+	struct urb *urb[ES2_CPORT_IN_URB_MAX];
+	unsigned int urb_count;
+	atomic_t in_flight;
+	atomic64_t completions;
+	atomic64_t ring_empty;
+	u64 scale_completions;
+	u64 scale_ring_empty;
+	struct list_head rx_list;
+	spinlock_t rx_lock;
+	struct mutex rx_mutex;
+	struct work_struct rx_work;
+	int rx_cpu;
+};
+
+/*
+ * A CPort OUT urb, either one of our pool or allocated dynamically when the
+ * pool has run dry.  Messages point to the urb carrying them through their
+ * hcpriv.
+ *
+ * @urb: the urb, whose context points back to us
+ * @context: the message the urb carries
+ * @agg: the aggregate transfer the urb carries instead, released along
+ *	with the urb
+ * @users: references held by the transfer in flight and by cancellers;
+ *	the urb is released when it drops to zero
+ * @index: position in the pool, or -1 for a dynamically allocated urb
+ * @rcu: defers freeing of a dynamically allocated urb, which a canceller
+ *	may be looking at
+ */
+struct es2_cport_out_urb {
+	struct urb *urb;
+	void *context;
+	struct es2_agg_transfer *agg;
+	atomic_t users;
+	int index;
+	struct rcu_head rcu;
+};
+
+struct es2_cport_out;
+
+/*
+ * A transfer of several messages sent back to back, each with its own
+ * header, and the CPort id packed into it as usual.  A message cancelled
+ * once the transfer has been submitted is only detached from it, for the
+ * others to still be sent.
+ *
+ * @cport_out: the endpoint the transfer is sent on
+ * @out_urb: the urb the transfer has been given, if any
+ * @status: the error that prevented the transfer from being submitted
+ * @done: whether the transfer has completed, after which messages are no
+ *	longer detached from it
+ * @count: number of messages in @messages
+ * @cancelled: number of messages detached from the transfer
+ * @size: total size of the messages copied into @buffer
+ * @messages: the messages carried by the transfer, or NULL once detached
+ * @buffer: the data of the transfer
+ */
+struct es2_agg_transfer {
+	struct es2_cport_out *cport_out;
+	struct es2_cport_out_urb *out_urb;
+	int status;
+	bool done;
+	unsigned int count;
+	unsigned int cancelled;
+	size_t size;
+	struct gb_message *messages[ES2_AGG_MSG_MAX];
+	u8 buffer[0];
 };
 
 /*
  * @endpoint: bulk out endpoint for CPort data
+ * @es2: the device the endpoint belongs to
+ * @agg_lock: locks @agg, and the messages of the transfers submitted
+ * @agg: the transfer small messages are being aggregated into, if any
+ * @agg_spare: a completed transfer kept around for reuse
+ * @agg_timer: submits @agg once the aggregation delay has expired
  */
 struct es2_cport_out {
 	__u8 endpoint;
+	struct es2_ap_dev *es2;
+	spinlock_t agg_lock;
+	struct es2_agg_transfer *agg;
+	struct es2_agg_transfer *agg_spare;
+	struct hrtimer agg_timer;
 };
 
 /**
@@ -86,12 +251,41 @@ struct es2_cport_out {
 
  * @cport_in: endpoint, urbs and buffer for cport in messages
  * @cport_out: endpoint for for cport out messages
- * @cport_out_urb: array of urbs for the CPort out messages
- * @cport_out_urb_busy: array of flags to see if the @cport_out_urb is busy or
- *			not.
- * @cport_out_urb_cancelled: array of flags indicating whether the
- *			corresponding @cport_out_urb is being cancelled
- * @cport_out_urb_lock: locks the @cport_out_urb_busy "list"
+ * @cport_out_urb: pool of urbs for the CPort out messages
+ * @cport_out_urb_map: bitmap of the @cport_out_urb that are free
+ * @cport_out_urb_free: number of @cport_out_urb that are free and not yet
+ *			reserved
+ * @cport_in_spare: list of spare CPort IN buffers
+ * @cport_in_spare_lock: locks the @cport_in_spare list
+ * @cport_in_lock: serialises changes to the number of CPort IN urbs
+ * @cport_in_depth: number of CPort IN urbs per endpoint, which scaling
+ *		never goes below
+ * @cport_in_size: size of the CPort IN buffers
+ * @cport_in_enabled: whether the CPort IN urbs are to be submitted
+ * @cport_in_autoscale: whether the CPort IN urbs are scaled to the load
+ * @cport_in_scale_work: work scaling the CPort IN urbs periodically
+ * @rx_poll: whether received transfers are processed by the pollers
+ * @rx_poll_budget: number of messages a poller processes per run, or zero
+ *		for no limit
+ * @rx_poll_cpu: CPU the pollers run on, or negative to spread them
+ *
+ * @cport_to_ep: endpoint pair each CPort is mapped to
+ * @cports: traffic of each CPort
+ * @ep_lock: serialises changes to @cport_to_ep
+ * @ep_balance_enabled: whether CPorts are to be balanced
+ * @ep_balance_interval_ms: interval at which CPorts are balanced over the
+ *			endpoint pairs, or zero (the default) to leave them
+ *			where they are
+ * @ep_balance_min_bytes: traffic, in bytes per interval, above which a
+ *			CPort is given an endpoint pair of its own
+ * @ep_balance_work: work balancing CPorts periodically
+ *
+ * @agg_delay_us: time small messages may wait for others to be sent
+ *		along with them, or zero to send every message on its own
+ * @out_transfers: number of CPort OUT transfers submitted
+ * @out_messages: number of messages carried by @out_transfers
+ * @in_transfers: number of CPort IN transfers received
+ * @in_messages: number of messages carried by @in_transfers
  *
  * @apb_log_task: task pointer for logging thread
  * @apb_log_dentry: file system entry for the log file interface
@@ -105,12 +299,34 @@ struct es2_ap_dev {
 
 	struct es2_cport_in cport_in[NUM_BULKS];
 	struct es2_cport_out cport_out[NUM_BULKS];
-	struct urb *cport_out_urb[NUM_CPORT_OUT_URB];
-	bool cport_out_urb_busy[NUM_CPORT_OUT_URB];
-	bool cport_out_urb_cancelled[NUM_CPORT_OUT_URB];
-	spinlock_t cport_out_urb_lock;
+	struct es2_cport_out_urb cport_out_urb[NUM_CPORT_OUT_URB];
+	DECLARE_BITMAP(cport_out_urb_map, NUM_CPORT_OUT_URB);
+	atomic_t cport_out_urb_free;
+	struct list_head cport_in_spare;
+	spinlock_t cport_in_spare_lock;
+	struct mutex cport_in_lock;
+	unsigned int cport_in_depth;
+	size_t cport_in_size;
+	bool cport_in_enabled;
+	bool cport_in_autoscale;
+	struct delayed_work cport_in_scale_work;
+	bool rx_poll;
+	u32 rx_poll_budget;
+	int rx_poll_cpu;
+
+	u32 agg_delay_us;
+	atomic64_t out_transfers;
+	atomic64_t out_messages;
+	atomic64_t in_transfers;
+	atomic64_t in_messages;
 
 	int *cport_to_ep;
+	struct es2_cport *cports;
+	struct mutex ep_lock;
+	bool ep_balance_enabled;
+	u32 ep_balance_interval_ms;
+	u32 ep_balance_min_bytes;
+	struct delayed_work ep_balance_work;
 
 	struct task_struct *apb_log_task;
 	struct dentry *apb_log_dentry;
@@ -135,7 +351,9 @@ static inline struct es2_ap_dev *hd_to_es2(struct gb_host_device *hd)
 	return (struct es2_ap_dev *)&hd->hd_priv;
 }
 
+static void cport_in_callback(struct urb *urb);
 static void cport_out_callback(struct urb *urb);
+static void cport_out_agg_callback(struct urb *urb);
 static void usb_log_enable(struct es2_ap_dev *es2);
 static void usb_log_disable(struct es2_ap_dev *es2);
 
@@ -144,13 +362,28 @@ static int cport_to_ep_pair(struct es2_ap_dev *es2, u16 cport_id)
 {
 	if (cport_id >= es2->hd->num_cports)
 		return 0;
-	return es2->cport_to_ep[cport_id];
+	return READ_ONCE(es2->cport_to_ep[cport_id]);
+}
+
+/* Account traffic of a cport, for it to be balanced over endpoint pairs */
+static void cport_account(struct es2_ap_dev *es2, u16 cport_id, size_t size)
+{
+	atomic64_add(size, &es2->cports[cport_id].bytes);
+}
+
+/* Report a message as sent, once it no longer ties its cport to a pair */
+static void es2_message_sent(struct gb_host_device *hd,
+				struct gb_message *message, int status)
+{
+	struct es2_ap_dev *es2 = hd_to_es2(hd);
+	u16 cport_id = message->operation->connection->hd_cport_id;
+
+	atomic_dec(&es2->cports[cport_id].out_pending);
+	greybus_message_sent(hd, message, status);
 }
 
 #define ES2_TIMEOUT	500	/* 500 ms for the SVC to do something */
 
-/* Disable for now until we work all of this out to keep a warning-free build */
-#if 0
 /* Test if the endpoints pair is already mapped to a cport */
 static int ep_pair_in_use(struct es2_ap_dev *es2, int ep_pair)
 {
@@ -163,7 +396,11 @@ static int ep_pair_in_use(struct es2_ap_dev *es2, int ep_pair)
 	return 0;
 }
 
-/* Configure the endpoint mapping and send the request to APBridge */
+/*
+ * Configure the endpoint mapping and send the request to APBridge.  Endpoint
+ * pair 0 is shared by all cports, while any other pair may only be mapped to
+ * a single cport.  Called with ep_lock held.
+ */
 static int map_cport_to_ep(struct es2_ap_dev *es2,
 				u16 cport_id, int ep_pair)
 {
@@ -181,7 +418,6 @@ static int map_cport_to_ep(struct es2_ap_dev *es2,
 	if (!cport_to_ep)
 		return -ENOMEM;
 
-	es2->cport_to_ep[cport_id] = ep_pair;
 	cport_to_ep->cport_id = cpu_to_le16(cport_id);
 	cport_to_ep->endpoint_in = es2->cport_in[ep_pair].endpoint;
 	cport_to_ep->endpoint_out = es2->cport_out[ep_pair].endpoint;
@@ -194,11 +430,17 @@ static int map_cport_to_ep(struct es2_ap_dev *es2,
 				 (char *)cport_to_ep,
 				 sizeof(*cport_to_ep),
 				 ES2_TIMEOUT);
-	if (retval == sizeof(*cport_to_ep))
-		retval = 0;
 	kfree(cport_to_ep);
+	if (retval != sizeof(*cport_to_ep)) {
+		dev_err(&es2->usb_dev->dev,
+			"failed to map cport %hu to endpoints %d: %d\n",
+			cport_id, ep_pair, retval);
+		return retval < 0 ? retval : -EIO;
+	}
 
-	return retval;
+	WRITE_ONCE(es2->cport_to_ep[cport_id], ep_pair);
+
+	return 0;
 }
 
 /* Unmap a cport: use the muxed endpoints pair */
@@ -206,7 +448,219 @@ static int unmap_cport(struct es2_ap_dev *es2, u16 cport_id)
 {
 	return map_cport_to_ep(es2, cport_id, 0);
 }
-#endif
+
+/*
+ * Move a cport to another endpoints pair.  Incoming messages already queued
+ * on the old bulk in endpoint may still arrive after those on the new one,
+ * so only cports of protocols which don't mind their requests being
+ * reordered are moved.  Outgoing ones are kept in order by only moving
+ * cports with no message in flight.  Called with ep_lock held.
+ */
+static int ep_balance_move(struct es2_ap_dev *es2, u16 cport_id, int ep_pair)
+{
+	if (!es2->cports[cport_id].unordered)
+		return -EPERM;
+	if (atomic_read(&es2->cports[cport_id].out_pending))
+		return -EBUSY;
+
+	return map_cport_to_ep(es2, cport_id, ep_pair);
+}
+
+/*
+ * Find the unmapped cport with the highest rate, above the minimum.  The svc
+ * cport and those of ordered protocols stay on the shared pair.
+ */
+static int ep_balance_candidate(struct es2_ap_dev *es2, u64 min_rate)
+{
+	struct es2_cport *cport;
+	int candidate = -1;
+	u64 rate = min_rate;
+	int i;
+
+	for (i = 0; i < es2->hd->num_cports; i++) {
+		cport = &es2->cports[i];
+		if (!cport->enabled || !cport->unordered ||
+		    es2->cport_to_ep[i] || i == GB_SVC_CPORT_ID)
+			continue;
+		if (cport->rate >= rate) {
+			rate = cport->rate;
+			candidate = i;
+		}
+	}
+
+	return candidate;
+}
+
+/*
+ * Balance cports over the endpoint pairs according to their traffic, so
+ * that bulk transfers of busy cports don't hold up the messages of the
+ * others on the shared pair.  Busy cports are given a pair of their own,
+ * taking it from a cport carrying less than half of their traffic if there
+ * is none left, and cports falling below half the minimum traffic are put
+ * back on the shared pair.
+ */
+static void es2_ep_balance_work(struct work_struct *work)
+{
+	struct es2_ap_dev *es2;
+	struct es2_cport *cport;
+	u64 min_rate;
+	u64 bytes;
+	int owner[NUM_BULKS];
+	int candidate;
+	int ep_pair;
+	int victim;
+	int i;
+
+	es2 = container_of(to_delayed_work(work), struct es2_ap_dev,
+				ep_balance_work);
+
+	mutex_lock(&es2->ep_lock);
+	if (!es2->ep_balance_enabled || !es2->ep_balance_interval_ms)
+		goto out_unlock;
+
+	min_rate = es2->ep_balance_min_bytes;
+
+	for (ep_pair = 0; ep_pair < NUM_BULKS; ep_pair++)
+		owner[ep_pair] = -1;
+
+	for (i = 0; i < es2->hd->num_cports; i++) {
+		cport = &es2->cports[i];
+		if (!cport->enabled)
+			continue;
+
+		bytes = atomic64_read(&cport->bytes);
+		cport->rate = (3 * cport->rate + bytes - cport->last_bytes) / 4;
+		cport->last_bytes = bytes;
+
+		ep_pair = es2->cport_to_ep[i];
+		if (!ep_pair)
+			continue;
+
+		if (cport->rate < min_rate / 2 && !ep_balance_move(es2, i, 0))
+			continue;
+
+		owner[ep_pair] = i;
+	}
+
+	while ((candidate = ep_balance_candidate(es2, min_rate)) >= 0) {
+		cport = &es2->cports[candidate];
+
+		for (ep_pair = 1; ep_pair < NUM_BULKS; ep_pair++) {
+			if (owner[ep_pair] < 0)
+				break;
+		}
+
+		if (ep_pair == NUM_BULKS) {
+			victim = -1;
+			for (i = 1; i < NUM_BULKS; i++) {
+				if (victim < 0 || es2->cports[owner[i]].rate <
+						es2->cports[owner[victim]].rate)
+					victim = i;
+			}
+
+			if (2 * es2->cports[owner[victim]].rate >= cport->rate)
+				break;
+			if (ep_balance_move(es2, owner[victim], 0))
+				break;
+
+			ep_pair = victim;
+			owner[ep_pair] = -1;
+		}
+
+		if (ep_balance_move(es2, candidate, ep_pair))
+			break;
+
+		owner[ep_pair] = candidate;
+	}
+
+	schedule_delayed_work(&es2->ep_balance_work,
+			msecs_to_jiffies(es2->ep_balance_interval_ms));
+out_unlock:
+	mutex_unlock(&es2->ep_lock);
+}
+
+static int ep_balance_interval_get(void *data, u64 *val)
+{
+	struct es2_ap_dev *es2 = data;
+
+	*val = es2->ep_balance_interval_ms;
+
+	return 0;
+}
+
+static int ep_balance_interval_set(void *data, u64 val)
+{
+	struct es2_ap_dev *es2 = data;
+
+	if (val > U32_MAX)
+		return -EINVAL;
+
+	mutex_lock(&es2->ep_lock);
+	es2->ep_balance_interval_ms = val;
+	if (val && es2->ep_balance_enabled) {
+		mod_delayed_work(system_wq, &es2->ep_balance_work,
+					msecs_to_jiffies(val));
+	}
+	mutex_unlock(&es2->ep_lock);
+
+	return 0;
+}
+
+DEFINE_SIMPLE_ATTRIBUTE(ep_balance_interval_fops, ep_balance_interval_get,
+			ep_balance_interval_set, "%llu\n");
+
+static int ep_mapping_show(struct seq_file *s, void *unused)
+{
+	struct es2_ap_dev *es2 = s->private;
+	struct es2_cport *cport;
+	int i;
+
+	seq_puts(s, "cport\tep_pair\tbytes\trate\n");
+
+	mutex_lock(&es2->ep_lock);
+	for (i = 0; i < es2->hd->num_cports; i++) {
+		cport = &es2->cports[i];
+		if (!cport->enabled)
+			continue;
+
+		seq_printf(s, "%d\t%d\t%llu\t%llu\n", i, es2->cport_to_ep[i],
+				(u64)atomic64_read(&cport->bytes),
+				cport->rate);
+	}
+	mutex_unlock(&es2->ep_lock);
+
+	return 0;
+}
+
+static int ep_mapping_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ep_mapping_show, inode->i_private);
+}
+
+static const struct file_operations ep_mapping_fops = {
+	.open		= ep_mapping_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int cport_in_urb_submit(struct es2_ap_dev *es2,
+				struct es2_cport_in *cport_in, struct urb *urb)
+{
+	int ret;
+
+	usb_unpoison_urb(urb);
+
+	atomic_inc(&cport_in->in_flight);
+	ret = usb_submit_urb(urb, GFP_KERNEL);
+	if (ret) {
+		atomic_dec(&cport_in->in_flight);
+		dev_err(&es2->usb_dev->dev, "failed to submit in-urb: %d\n",
+			ret);
+	}
+
+	return ret;
+}
 
 static int es2_cport_in_enable(struct es2_ap_dev *es2,
 				struct es2_cport_in *cport_in)
@@ -215,15 +669,12 @@ static int es2_cport_in_enable(struct es2_ap_dev *es2,
 	int ret;
 	int i;
 
-	for (i = 0; i < NUM_CPORT_IN_URB; ++i) {
+	for (i = 0; i < cport_in->urb_count; ++i) {
 		urb = cport_in->urb[i];
 
-		ret = usb_submit_urb(urb, GFP_KERNEL);
-		if (ret) {
-			dev_err(&es2->usb_dev->dev,
-					"failed to submit in-urb: %d\n", ret);
+		ret = cport_in_urb_submit(es2, cport_in, urb);
+		if (ret)
 			goto err_kill_urbs;
-		}
 	}
 
 	return 0;
@@ -237,197 +688,1112 @@ err_kill_urbs:
 	return ret;
 }
 
+/*
+ * Stop a CPort IN urb.  Poisoning it keeps the poller from resubmitting it,
+ * and once the poller is done with the urbs it has taken, the urb can only
+ * be waiting on the rx list, if anywhere.
+ */
+static void cport_in_urb_stop(struct es2_cport_in *cport_in,
+				struct urb *urb)
+{
+	usb_poison_urb(urb);
+
+	mutex_lock(&cport_in->rx_mutex);
+	spin_lock_irq(&cport_in->rx_lock);
+	list_del_init(&urb->urb_list);
+	spin_unlock_irq(&cport_in->rx_lock);
+	mutex_unlock(&cport_in->rx_mutex);
+}
+
 static void es2_cport_in_disable(struct es2_ap_dev *es2,
 				struct es2_cport_in *cport_in)
 {
 	struct urb *urb;
 	int i;
 
-	for (i = 0; i < NUM_CPORT_IN_URB; ++i) {
+	for (i = 0; i < cport_in->urb_count; ++i) {
 		urb = cport_in->urb[i];
-		usb_kill_urb(urb);
+		cport_in_urb_stop(cport_in, urb);
 	}
 }
 
-static struct urb *next_free_urb(struct es2_ap_dev *es2, gfp_t gfp_mask)
+static struct urb *cport_in_urb_alloc(struct es2_ap_dev *es2,
+					struct es2_cport_in *cport_in)
 {
-	struct urb *urb = NULL;
-	unsigned long flags;
-	int i;
+	struct usb_device *udev = es2->usb_dev;
+	struct urb *urb;
+	u8 *buffer;
 
-	spin_lock_irqsave(&es2->cport_out_urb_lock, flags);
+	urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (!urb)
+		return NULL;
 
-	/* Look in our pool of allocated urbs first, as that's the "fastest" */
-	for (i = 0; i < NUM_CPORT_OUT_URB; ++i) {
-		if (es2->cport_out_urb_busy[i] == false &&
-				es2->cport_out_urb_cancelled[i] == false) {
-			es2->cport_out_urb_busy[i] = true;
-			urb = es2->cport_out_urb[i];
-			break;
-		}
+	buffer = kmalloc(es2->cport_in_size, GFP_KERNEL);
+	if (!buffer) {
+		usb_free_urb(urb);
+		return NULL;
 	}
-	spin_unlock_irqrestore(&es2->cport_out_urb_lock, flags);
-	if (urb)
-		return urb;
 
-	/*
-	 * Crap, pool is empty, complain to the syslog and go allocate one
-	 * dynamically as we have to succeed.
-	 */
-	dev_err(&es2->usb_dev->dev,
-		"No free CPort OUT urbs, having to dynamically allocate one!\n");
-	return usb_alloc_urb(0, gfp_mask);
+	usb_fill_bulk_urb(urb, udev,
+			  usb_rcvbulkpipe(udev, cport_in->endpoint),
+			  buffer, es2->cport_in_size,
+			  cport_in_callback, cport_in);
+
+	return urb;
 }
 
-static void free_urb(struct es2_ap_dev *es2, struct urb *urb)
+static void cport_in_urb_free(struct urb *urb)
 {
-	unsigned long flags;
-	int i;
-	/*
-	 * See if this was an urb in our pool, if so mark it "free", otherwise
-	 * we need to free it ourselves.
-	 */
-	spin_lock_irqsave(&es2->cport_out_urb_lock, flags);
-	for (i = 0; i < NUM_CPORT_OUT_URB; ++i) {
-		if (urb == es2->cport_out_urb[i]) {
-			es2->cport_out_urb_busy[i] = false;
-			urb = NULL;
-			break;
+	kfree(urb->transfer_buffer);
+	usb_free_urb(urb);
+}
+
+/*
+ * Change the number of urbs of a CPort IN endpoint, submitting the new ones
+ * if the endpoint is enabled.  Called with cport_in_lock held.
+ */
+static int es2_cport_in_resize(struct es2_ap_dev *es2,
+				struct es2_cport_in *cport_in,
+				unsigned int count)
+{
+	struct urb *urb;
+	int ret;
+
+	while (cport_in->urb_count < count) {
+		urb = cport_in_urb_alloc(es2, cport_in);
+		if (!urb)
+			return -ENOMEM;
+
+		if (es2->cport_in_enabled) {
+			ret = cport_in_urb_submit(es2, cport_in, urb);
+			if (ret) {
+				cport_in_urb_free(urb);
+				return ret;
+			}
 		}
+
+		cport_in->urb[cport_in->urb_count++] = urb;
 	}
-	spin_unlock_irqrestore(&es2->cport_out_urb_lock, flags);
 
-	/* If urb is not NULL, then we need to free this urb */
-	usb_free_urb(urb);
+	while (cport_in->urb_count > count) {
+		urb = cport_in->urb[--cport_in->urb_count];
+		cport_in_urb_stop(cport_in, urb);
+		cport_in_urb_free(urb);
+		cport_in->urb[cport_in->urb_count] = NULL;
+	}
+
+	return 0;
 }
 
 /*
- * We (ab)use the operation-message header pad bytes to transfer the
- * cport id in order to minimise overhead.
+ * Scale the number of CPort IN urbs to the load: endpoints that have run
+ * out of submitted urbs since the last run get another one, while idle ones
+ * give one back, down to the configured depth.
  */
-static void
-gb_message_cport_pack(struct gb_operation_msg_hdr *header, u16 cport_id)
+static void es2_cport_in_scale_work(struct work_struct *work)
 {
-	header->pad[0] = cport_id;
+	struct es2_ap_dev *es2;
+	struct es2_cport_in *cport_in;
+	unsigned int count;
+	u64 completions;
+	u64 ring_empty;
+	int i;
+
+	es2 = container_of(to_delayed_work(work), struct es2_ap_dev,
+				cport_in_scale_work);
+
+	mutex_lock(&es2->cport_in_lock);
+	if (!es2->cport_in_enabled || !es2->cport_in_autoscale)
+		goto out_unlock;
+
+	for (i = 0; i < NUM_BULKS; ++i) {
+		cport_in = &es2->cport_in[i];
+		count = cport_in->urb_count;
+
+		completions = atomic64_read(&cport_in->completions);
+		ring_empty = atomic64_read(&cport_in->ring_empty);
+
+		if (ring_empty != cport_in->scale_ring_empty) {
+			if (count < ES2_CPORT_IN_URB_MAX)
+				count++;
+		} else if (completions == cport_in->scale_completions) {
+			if (count > es2->cport_in_depth)
+				count--;
+		}
+
+		cport_in->scale_completions = completions;
+		cport_in->scale_ring_empty = ring_empty;
+
+		if (count != cport_in->urb_count)
+			es2_cport_in_resize(es2, cport_in, count);
+	}
+
+	schedule_delayed_work(&es2->cport_in_scale_work,
+				ES2_CPORT_IN_SCALE_INTERVAL);
+out_unlock:
+	mutex_unlock(&es2->cport_in_lock);
 }
 
-/* Clear the pad bytes used for the CPort id */
-static void gb_message_cport_clear(struct gb_operation_msg_hdr *header)
+static int cport_in_urbs_get(void *data, u64 *val)
 {
-	header->pad[0] = 0;
+	struct es2_ap_dev *es2 = data;
+
+	*val = es2->cport_in_depth;
+
+	return 0;
 }
 
-/* Extract the CPort id packed into the header, and clear it */
-static u16 gb_message_cport_unpack(struct gb_operation_msg_hdr *header)
+static int cport_in_urbs_set(void *data, u64 val)
 {
-	u16 cport_id = header->pad[0];
+	struct es2_ap_dev *es2 = data;
+	int ret = 0;
+	int i;
 
-	gb_message_cport_clear(header);
+	if (!val || val > ES2_CPORT_IN_URB_MAX)
+		return -EINVAL;
 
-	return cport_id;
+	mutex_lock(&es2->cport_in_lock);
+	es2->cport_in_depth = val;
+	for (i = 0; i < NUM_BULKS; ++i) {
+		ret = es2_cport_in_resize(es2, &es2->cport_in[i], val);
+		if (ret)
+			break;
+	}
+	mutex_unlock(&es2->cport_in_lock);
+
+	return ret;
+}
+
+DEFINE_SIMPLE_ATTRIBUTE(cport_in_urbs_fops, cport_in_urbs_get,
+			cport_in_urbs_set, "%llu\n");
+
+static int cport_in_autoscale_get(void *data, u64 *val)
+{
+	struct es2_ap_dev *es2 = data;
+
+	*val = es2->cport_in_autoscale;
+
+	return 0;
+}
+
+static int cport_in_autoscale_set(void *data, u64 val)
+{
+	struct es2_ap_dev *es2 = data;
+
+	mutex_lock(&es2->cport_in_lock);
+	es2->cport_in_autoscale = !!val;
+	if (es2->cport_in_autoscale && es2->cport_in_enabled) {
+		schedule_delayed_work(&es2->cport_in_scale_work,
+					ES2_CPORT_IN_SCALE_INTERVAL);
+	}
+	mutex_unlock(&es2->cport_in_lock);
+
+	return 0;
 }
 
+DEFINE_SIMPLE_ATTRIBUTE(cport_in_autoscale_fops, cport_in_autoscale_get,
+			cport_in_autoscale_set, "%llu\n");
+
 /*
- * Returns zero if the message was successfully queued, or a negative errno
- * otherwise.
+ * Set the CPU the pollers run on.  A negative value spreads the endpoints
+ * over the online CPUs.
+ */
+static void es2_rx_cpu_set(struct es2_ap_dev *es2, int cpu)
+{
+	int target;
+	int n;
+	int i;
+
+	es2->rx_poll_cpu = cpu;
+	for (i = 0; i < NUM_BULKS; ++i) {
+		target = cpu;
+		if (target < 0) {
+			n = i % num_online_cpus();
+			for_each_online_cpu(target) {
+				if (!n--)
+					break;
+			}
+		}
+		WRITE_ONCE(es2->cport_in[i].rx_cpu, target);
+	}
+}
+
+static int rx_poll_cpu_get(void *data, u64 *val)
+{
+	struct es2_ap_dev *es2 = data;
+
+	*val = (s64)es2->rx_poll_cpu;
+
+	return 0;
+}
+
+static int rx_poll_cpu_set(void *data, u64 val)
+{
+	struct es2_ap_dev *es2 = data;
+	s64 cpu = (s64)val;
+
+	if (cpu >= (s64)nr_cpu_ids)
+		return -EINVAL;
+
+	es2_rx_cpu_set(es2, cpu < 0 ? -1 : cpu);
+
+	return 0;
+}
+
+DEFINE_SIMPLE_ATTRIBUTE(rx_poll_cpu_fops, rx_poll_cpu_get, rx_poll_cpu_set,
+			"%lld\n");
+
+static int cport_in_show(struct seq_file *s, void *unused)
+{
+	struct es2_ap_dev *es2 = s->private;
+	struct es2_cport_in *cport_in;
+	int i;
+
+	seq_puts(s, "ep\turbs\tcompletions\tring_empty\tcpu\n");
+	for (i = 0; i < NUM_BULKS; ++i) {
+		cport_in = &es2->cport_in[i];
+		seq_printf(s, "0x%02x\t%u\t%llu\t%llu\t%d\n",
+				cport_in->endpoint,
+				READ_ONCE(cport_in->urb_count),
+				(u64)atomic64_read(&cport_in->completions),
+				(u64)atomic64_read(&cport_in->ring_empty),
+				READ_ONCE(cport_in->rx_cpu));
+	}
+
+	return 0;
+}
+
+static int cport_in_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, cport_in_show, inode->i_private);
+}
+
+static const struct file_operations cport_in_fops = {
+	.open		= cport_in_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/*
+ * Spare CPort IN buffers are kept on a list, linked through their own
+ * storage while unused.
+ */
+static u8 *cport_in_spare_get(struct es2_ap_dev *es2)
+{
+	struct list_head *entry = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&es2->cport_in_spare_lock, flags);
+	if (!list_empty(&es2->cport_in_spare)) {
+		entry = es2->cport_in_spare.next;
+		list_del(entry);
+	}
+	spin_unlock_irqrestore(&es2->cport_in_spare_lock, flags);
+
+	return (u8 *)entry;
+}
+
+static void cport_in_spare_put(struct es2_ap_dev *es2, u8 *buffer)
+{
+	struct list_head *entry = (struct list_head *)buffer;
+	unsigned long flags;
+
+	spin_lock_irqsave(&es2->cport_in_spare_lock, flags);
+	list_add(entry, &es2->cport_in_spare);
+	spin_unlock_irqrestore(&es2->cport_in_spare_lock, flags);
+}
+
+/* Called by the greybus core when done with a buffer we lent it */
+static void rx_buffer_release(struct gb_host_device *hd, void *cookie)
+{
+	cport_in_spare_put(hd_to_es2(hd), cookie);
+}
+
+/*
+ * Number of pool urbs kept back from messages of each priority class, so
+ * that bulk transfers cannot starve input events and control requests of
+ * pre-allocated urbs.
+ */
+static const unsigned int cport_out_urb_reserve[GB_OPERATION_PRIORITY_COUNT] = {
+	[GB_OPERATION_PRIORITY_HIGH]	= 0,
+	[GB_OPERATION_PRIORITY_NORMAL]	= NUM_CPORT_OUT_URB / 8,
+	[GB_OPERATION_PRIORITY_LOW]	= NUM_CPORT_OUT_URB / 4,
+};
+
+/*
+ * The pool is handed out without locking: a free urb is first reserved by
+ * decrementing the count of free urbs, as long as it stays above what is
+ * kept back from the class, and then claimed by clearing its bit in the
+ * bitmap.  Released urbs are put back in the bitmap before they are counted
+ * again, so that a reservation always finds a bit to claim.
+ */
+static bool cport_out_urb_reserve_one(struct es2_ap_dev *es2,
+					unsigned int reserve)
+{
+	int free = atomic_read(&es2->cport_out_urb_free);
+	int old;
+
+	while (free > (int)reserve) {
+		old = atomic_cmpxchg(&es2->cport_out_urb_free, free, free - 1);
+		if (old == free)
+			return true;
+		free = old;
+	}
+
+	return false;
+}
+
+static struct es2_cport_out_urb *cport_out_urb_claim(struct es2_ap_dev *es2)
+{
+	unsigned long i;
+
+	for (;;) {
+		i = find_first_bit(es2->cport_out_urb_map, NUM_CPORT_OUT_URB);
+		if (i < NUM_CPORT_OUT_URB &&
+		    test_and_clear_bit(i, es2->cport_out_urb_map))
+			return &es2->cport_out_urb[i];
+		cpu_relax();
+	}
+}
+
+static struct es2_cport_out_urb *cport_out_urb_alloc(gfp_t gfp_mask)
+{
+	struct es2_cport_out_urb *out_urb;
+
+	out_urb = kzalloc(sizeof(*out_urb), gfp_mask);
+	if (!out_urb)
+		return NULL;
+
+	out_urb->urb = usb_alloc_urb(0, gfp_mask);
+	if (!out_urb->urb) {
+		kfree(out_urb);
+		return NULL;
+	}
+	out_urb->index = -1;
+
+	return out_urb;
+}
+
+static void cport_out_urb_free_rcu(struct rcu_head *rcu)
+{
+	struct es2_cport_out_urb *out_urb;
+
+	out_urb = container_of(rcu, struct es2_cport_out_urb, rcu);
+	usb_free_urb(out_urb->urb);
+	kfree(out_urb);
+}
+
+/*
+ * Get up to count urbs for messages of the given priority class, from our
+ * pool as far as the class may.  Returns the number of urbs stored in
+ * out_urbs.
+ */
+static unsigned int next_free_urbs(struct es2_ap_dev *es2,
+					struct es2_cport_out_urb **out_urbs,
+					unsigned int count, u8 priority,
+					gfp_t gfp_mask)
+{
+	unsigned int reserve = cport_out_urb_reserve[priority];
+	unsigned int n;
+
+	/* Look in our pool of allocated urbs first, as that's the "fastest" */
+	for (n = 0; n < count; n++) {
+		if (!cport_out_urb_reserve_one(es2, reserve))
+			break;
+		out_urbs[n] = cport_out_urb_claim(es2);
+		atomic_set(&out_urbs[n]->users, 1);
+	}
+
+	/*
+	 * Crap, pool is empty (for this class at least), complain to the
+	 * syslog and go allocate the rest dynamically as we have to succeed.
+	 */
+	if (n < count && !reserve) {
+		dev_err(&es2->usb_dev->dev,
+			"No free CPort OUT urbs, having to dynamically allocate one!\n");
+	}
+	for (; n < count; n++) {
+		out_urbs[n] = cport_out_urb_alloc(gfp_mask);
+		if (!out_urbs[n])
+			break;
+		atomic_set(&out_urbs[n]->users, 1);
+	}
+
+	return n;
+}
+
+static struct es2_cport_out_urb *next_free_urb(struct es2_ap_dev *es2,
+						u8 priority, gfp_t gfp_mask)
+{
+	struct es2_cport_out_urb *out_urb;
+
+	if (!next_free_urbs(es2, &out_urb, 1, priority, gfp_mask))
+		return NULL;
+
+	return out_urb;
+}
+
+/* Release an aggregate transfer, keeping it for reuse if we have none */
+static void es2_agg_free(struct es2_agg_transfer *agg)
+{
+	if (cmpxchg(&agg->cport_out->agg_spare, NULL, agg))
+		kfree(agg);
+}
+
+/* Drop a reference to an urb, releasing it once it is no longer used */
+static void free_urb(struct es2_ap_dev *es2, struct es2_cport_out_urb *out_urb)
+{
+	struct es2_agg_transfer *agg;
+
+	if (!atomic_dec_and_test(&out_urb->users))
+		return;
+
+	/* A canceller may have been looking at its aggregate transfer */
+	agg = out_urb->agg;
+	if (agg) {
+		out_urb->agg = NULL;
+		es2_agg_free(agg);
+	}
+
+	/* If this was not an urb in our pool, we need to free it ourselves */
+	if (out_urb->index < 0) {
+		call_rcu(&out_urb->rcu, cport_out_urb_free_rcu);
+		return;
+	}
+
+	WARN_ON(test_and_set_bit(out_urb->index, es2->cport_out_urb_map));
+	atomic_inc(&es2->cport_out_urb_free);
+}
+
+/*
+ * Get a reference to the urb carrying a message, if any.  The urb may have
+ * completed and been reused in the meantime, but the association with the
+ * message is undone before the urb is released, so the urb still carries
+ * the message if the association is still there once we hold a reference.
+ */
+static struct es2_cport_out_urb *
+cport_out_urb_get_message(struct es2_ap_dev *es2, struct gb_message *message)
+{
+	struct es2_cport_out_urb *out_urb;
+
+	rcu_read_lock();
+	out_urb = READ_ONCE(message->hcpriv);
+	if (out_urb && !atomic_inc_not_zero(&out_urb->users))
+		out_urb = NULL;
+	rcu_read_unlock();
+
+	if (out_urb && READ_ONCE(message->hcpriv) != out_urb) {
+		free_urb(es2, out_urb);
+		out_urb = NULL;
+	}
+
+	return out_urb;
+}
+
+/*
+ * We (ab)use the operation-message header pad bytes to transfer the
+ * cport id in order to minimise overhead.
+ */
+static void
+gb_message_cport_pack(struct gb_operation_msg_hdr *header, u16 cport_id)
+{
+	header->pad[0] = cport_id;
+}
+
+/* Clear the pad bytes used for the CPort id */
+static void gb_message_cport_clear(struct gb_operation_msg_hdr *header)
+{
+	header->pad[0] = 0;
+}
+
+/* Extract the CPort id packed into the header, and clear it */
+static u16 gb_message_cport_unpack(struct gb_operation_msg_hdr *header)
+{
+	u16 cport_id = header->pad[0];
+
+	gb_message_cport_clear(header);
+
+	return cport_id;
+}
+
+/*
+ * Describe a message with a scatterlist payload to the host controller as a
+ * list of the message buffer followed by the payload entries.  The list is
+ * freed by message_sg_free() once the urb is done with.
+ */
+static int message_sg_init(struct urb *urb, struct gb_message *message,
+			gfp_t gfp_mask)
+{
+	struct scatterlist *sgl;
+	struct scatterlist *sg = message->sg;
+	size_t skip = message->sg_skip;
+	size_t left = message->sg_size;
+	unsigned int nents = message->sg_nents + 1;
+	unsigned int len;
+	unsigned int i;
+
+	sgl = kmalloc_array(nents, sizeof(*sgl), gfp_mask);
+	if (!sgl)
+		return -ENOMEM;
+
+	sg_init_table(sgl, nents);
+	sg_set_buf(&sgl[0], message->buffer,
+		   sizeof(*message->header) + message->payload_size);
+
+	for (i = 1; i < nents; i++) {
+		len = min_t(size_t, sg->length - skip, left);
+		sg_set_page(&sgl[i], sg_page(sg), len, sg->offset + skip);
+		left -= len;
+		skip = 0;
+		sg = sg_next(sg);
+	}
+
+	urb->transfer_buffer = NULL;
+	urb->sg = sgl;
+	urb->num_sgs = nents;
+
+	return 0;
+}
+
+static void message_sg_free(struct urb *urb)
+{
+	kfree(urb->sg);
+	urb->sg = NULL;
+	urb->num_sgs = 0;
+}
+
+/*
+ * Submit a message using an urb that has already been associated with it
+ * through message->hcpriv.  On failure, the association is undone and the
+ * urb is released.
+ */
+static int message_submit(struct es2_ap_dev *es2, u16 cport_id,
+			struct gb_message *message,
+			struct es2_cport_out_urb *out_urb, gfp_t gfp_mask)
+{
+	struct usb_device *udev = es2->usb_dev;
+	struct urb *urb = out_urb->urb;
+	size_t buffer_size;
+	int retval;
+	int ep_pair;
+
+	/* Pack the cport id into the message header */
+	gb_message_cport_pack(message->header, cport_id);
+
+	buffer_size = gb_message_size(message);
+
+	ep_pair = cport_to_ep_pair(es2, cport_id);
+	usb_fill_bulk_urb(urb, udev,
+			  usb_sndbulkpipe(udev,
+					  es2->cport_out[ep_pair].endpoint),
+			  message->buffer, buffer_size,
+			  cport_out_callback, out_urb);
+	urb->transfer_flags |= URB_ZERO_PACKET;
+	out_urb->context = message;
+
+	if (message->sg) {
+		retval = message_sg_init(urb, message, gfp_mask);
+		if (retval)
+			goto err_release;
+	}
+
+	trace_gb_host_device_send(es2->hd, cport_id, buffer_size);
+	cport_account(es2, cport_id, buffer_size);
+	retval = usb_submit_urb(urb, gfp_mask);
+	if (retval) {
+		dev_err(&udev->dev, "failed to submit out-urb: %d\n", retval);
+		message_sg_free(urb);
+		goto err_release;
+	}
+
+	atomic64_inc(&es2->out_transfers);
+	atomic64_inc(&es2->out_messages);
+
+	return 0;
+
+err_release:
+	WRITE_ONCE(message->hcpriv, NULL);
+	free_urb(es2, out_urb);
+	gb_message_cport_clear(message->header);
+
+	return retval;
+}
+
+/*
+ * Report the messages of an aggregate transfer still attached to it as
+ * sent, and release the transfer, along with its urb if it was given one.
+ */
+static void es2_agg_complete(struct es2_agg_transfer *agg, int status)
+{
+	struct es2_ap_dev *es2 = agg->cport_out->es2;
+	unsigned int i;
+
+	for (i = 0; i < agg->count; i++) {
+		if (agg->messages[i])
+			es2_message_sent(es2->hd, agg->messages[i], status);
+	}
+
+	if (agg->out_urb)
+		free_urb(es2, agg->out_urb);
+	else
+		es2_agg_free(agg);
+}
+
+/*
+ * Submit the transfer being aggregated on an endpoint, if any.  Called
+ * with agg_lock held.
+ *
+ * Returns NULL if there was nothing to submit or on success.  Otherwise
+ * returns the transfer, for the caller to report its messages as failed
+ * with es2_agg_complete() once the lock has been released.
+ */
+static struct es2_agg_transfer *es2_agg_flush(struct es2_cport_out *cport_out)
+{
+	struct es2_ap_dev *es2 = cport_out->es2;
+	struct usb_device *udev = es2->usb_dev;
+	struct es2_agg_transfer *agg = cport_out->agg;
+	u8 priority = GB_OPERATION_PRIORITY_LOW;
+	struct es2_cport_out_urb *out_urb;
+	unsigned int i;
+	int retval;
+
+	if (!agg)
+		return NULL;
+
+	cport_out->agg = NULL;
+	hrtimer_try_to_cancel(&cport_out->agg_timer);
+
+	/* All of its messages may have been cancelled */
+	if (!agg->count) {
+		es2_agg_free(agg);
+		return NULL;
+	}
+
+	for (i = 0; i < agg->count; i++)
+		priority = min(priority, agg->messages[i]->operation->priority);
+
+	out_urb = next_free_urb(es2, priority, GFP_ATOMIC);
+	if (!out_urb) {
+		agg->status = -ENOMEM;
+		return agg;
+	}
+
+	agg->out_urb = out_urb;
+	out_urb->agg = agg;
+	for (i = 0; i < agg->count; i++)
+		WRITE_ONCE(agg->messages[i]->hcpriv, out_urb);
+
+	usb_fill_bulk_urb(out_urb->urb, udev,
+			  usb_sndbulkpipe(udev, cport_out->endpoint),
+			  agg->buffer, agg->size,
+			  cport_out_agg_callback, out_urb);
+	out_urb->urb->transfer_flags |= URB_ZERO_PACKET;
+
+	retval = usb_submit_urb(out_urb->urb, GFP_ATOMIC);
+	if (retval) {
+		dev_err(&udev->dev, "failed to submit out-urb: %d\n", retval);
+
+		for (i = 0; i < agg->count; i++)
+			WRITE_ONCE(agg->messages[i]->hcpriv, NULL);
+
+		agg->done = true;
+		agg->status = retval;
+		return agg;
+	}
+
+	atomic64_inc(&es2->out_transfers);
+	atomic64_add(agg->count, &es2->out_messages);
+
+	return NULL;
+}
+
+/* Submit whatever has been aggregated once the delay has expired */
+static enum hrtimer_restart es2_agg_timer(struct hrtimer *timer)
+{
+	struct es2_cport_out *cport_out;
+	struct es2_agg_transfer *failed;
+	unsigned long flags;
+
+	cport_out = container_of(timer, struct es2_cport_out, agg_timer);
+
+	spin_lock_irqsave(&cport_out->agg_lock, flags);
+	failed = es2_agg_flush(cport_out);
+	spin_unlock_irqrestore(&cport_out->agg_lock, flags);
+
+	if (failed)
+		es2_agg_complete(failed, failed->status);
+
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Submit any messages aggregated on an endpoint, so that a message sent on
+ * its own does not overtake them.
+ */
+static void es2_agg_flush_now(struct es2_cport_out *cport_out)
+{
+	struct es2_agg_transfer *failed;
+	unsigned long flags;
+
+	if (!READ_ONCE(cport_out->agg))
+		return;
+
+	spin_lock_irqsave(&cport_out->agg_lock, flags);
+	failed = es2_agg_flush(cport_out);
+	spin_unlock_irqrestore(&cport_out->agg_lock, flags);
+
+	if (failed)
+		es2_agg_complete(failed, failed->status);
+}
+
+/*
+ * Queue a small message to be sent along with others on its endpoint.  The
+ * message is copied into the transfer being aggregated, which is submitted
+ * when it can't take another small message, or at the latest once the
+ * aggregation delay of its first message has expired.
+ *
+ * Returns zero if the message was queued, or -ENOMEM if it has to be sent
+ * on its own.
+ */
+static int es2_agg_queue(struct es2_cport_out *cport_out, u16 cport_id,
+			struct gb_message *message)
+{
+	struct es2_ap_dev *es2 = cport_out->es2;
+	struct es2_agg_transfer *failed = NULL;
+	struct es2_agg_transfer *agg;
+	size_t size = gb_message_size(message);
+	unsigned long flags;
+
+	spin_lock_irqsave(&cport_out->agg_lock, flags);
+	agg = cport_out->agg;
+	if (!agg) {
+		agg = xchg(&cport_out->agg_spare, NULL);
+		if (!agg) {
+			agg = kmalloc(sizeof(*agg) + ES2_GBUF_MSG_SIZE_MAX,
+					GFP_ATOMIC);
+		}
+		if (!agg) {
+			spin_unlock_irqrestore(&cport_out->agg_lock, flags);
+			return -ENOMEM;
+		}
+
+		agg->cport_out = cport_out;
+		agg->out_urb = NULL;
+		agg->status = 0;
+		agg->done = false;
+		agg->count = 0;
+		agg->cancelled = 0;
+		agg->size = 0;
+		cport_out->agg = agg;
+
+		hrtimer_start(&cport_out->agg_timer,
+				ns_to_ktime((u64)READ_ONCE(es2->agg_delay_us) *
+						NSEC_PER_USEC),
+				HRTIMER_MODE_REL);
+	}
+
+	gb_message_cport_pack(message->header, cport_id);
+	memcpy(agg->buffer + agg->size, message->buffer, size);
+	gb_message_cport_clear(message->header);
+	cport_account(es2, cport_id, size);
+
+	agg->messages[agg->count++] = message;
+	agg->size += size;
+
+	trace_gb_host_device_send(es2->hd, cport_id, size);
+
+	/* Don't wait any longer if there's no room for another message */
+	if (agg->count == ES2_AGG_MSG_MAX ||
+	    agg->size + ES2_AGG_MSG_SIZE_MAX > ES2_GBUF_MSG_SIZE_MAX)
+		failed = es2_agg_flush(cport_out);
+	spin_unlock_irqrestore(&cport_out->agg_lock, flags);
+
+	if (failed)
+		es2_agg_complete(failed, failed->status);
+
+	return 0;
+}
+
+/*
+ * Remove a message from the transfer being aggregated on an endpoint, if
+ * it is still there.  Called with agg_lock held.
+ */
+static bool es2_agg_remove(struct es2_cport_out *cport_out,
+				struct gb_message *message)
+{
+	struct es2_agg_transfer *agg = cport_out->agg;
+	size_t offset = 0;
+	size_t size = 0;
+	unsigned int i;
+
+	if (!agg)
+		return false;
+
+	for (i = 0; i < agg->count; i++) {
+		size = gb_message_size(agg->messages[i]);
+		if (agg->messages[i] == message)
+			break;
+		offset += size;
+	}
+	if (i == agg->count)
+		return false;
+
+	memmove(agg->buffer + offset, agg->buffer + offset + size,
+		agg->size - offset - size);
+	agg->size -= size;
+
+	agg->count--;
+	memmove(&agg->messages[i], &agg->messages[i + 1],
+		(agg->count - i) * sizeof(agg->messages[0]));
+
+	return true;
+}
+
+/*
+ * Returns zero if the message was successfully queued, or a negative errno
+ * otherwise.
+ */
+static int message_send(struct gb_host_device *hd, u16 cport_id,
+			struct gb_message *message, gfp_t gfp_mask)
+{
+	struct es2_ap_dev *es2 = hd_to_es2(hd);
+	struct usb_device *udev = es2->usb_dev;
+	struct es2_cport_out *cport_out;
+	struct es2_cport_out_urb *out_urb;
+	atomic_t *pending;
+	int retval;
+
+	/*
+	 * The data actually transferred will include an indication
+	 * of where the data should be sent.  Do one last check of
+	 * the target CPort id before filling it in.
+	 */
+	if (!cport_id_valid(hd, cport_id)) {
+		dev_err(&udev->dev, "invalid destination cport 0x%02x\n",
+				cport_id);
+		return -EINVAL;
+	}
+
+	/* Keep the cport on its endpoints pair until the message is sent */
+	pending = &es2->cports[cport_id].out_pending;
+	atomic_inc(pending);
+	smp_mb__after_atomic();
+
+	cport_out = &es2->cport_out[cport_to_ep_pair(es2, cport_id)];
+	if (READ_ONCE(es2->agg_delay_us) && !message->sg &&
+	    gb_message_size(message) <= ES2_AGG_MSG_SIZE_MAX) {
+		if (!es2_agg_queue(cport_out, cport_id, message))
+			return 0;
+	}
+	es2_agg_flush_now(cport_out);
+
+	/* Find a free urb */
+	out_urb = next_free_urb(es2, message->operation->priority, gfp_mask);
+	if (!out_urb) {
+		atomic_dec(pending);
+		return -ENOMEM;
+	}
+
+	WRITE_ONCE(message->hcpriv, out_urb);
+
+	retval = message_submit(es2, cport_id, message, out_urb, gfp_mask);
+	if (retval)
+		atomic_dec(pending);
+
+	return retval;
+}
+
+/*
+ * Queue a batch of messages, reserving their urbs before submitting any.
+ *
+ * Returns the number of messages queued, or a negative errno if none were.
  */
-static int message_send(struct gb_host_device *hd, u16 cport_id,
-			struct gb_message *message, gfp_t gfp_mask)
+static int message_send_batch(struct gb_host_device *hd, u16 cport_id,
+			struct gb_message **messages, unsigned int count,
+			gfp_t gfp_mask)
 {
 	struct es2_ap_dev *es2 = hd_to_es2(hd);
 	struct usb_device *udev = es2->usb_dev;
-	size_t buffer_size;
-	int retval;
-	struct urb *urb;
-	int ep_pair;
-	unsigned long flags;
+	struct es2_cport_out_urb *out_urbs[GB_HD_MESSAGE_BATCH_MAX];
+	atomic_t *pending;
+	unsigned int n;
+	unsigned int i, j;
+	int retval = 0;
 
-	/*
-	 * The data actually transferred will include an indication
-	 * of where the data should be sent.  Do one last check of
-	 * the target CPort id before filling it in.
-	 */
 	if (!cport_id_valid(hd, cport_id)) {
 		dev_err(&udev->dev, "invalid destination cport 0x%02x\n",
 				cport_id);
 		return -EINVAL;
 	}
 
-	/* Find a free urb */
-	urb = next_free_urb(es2, gfp_mask);
-	if (!urb)
+	if (WARN_ON(count > GB_HD_MESSAGE_BATCH_MAX))
+		count = GB_HD_MESSAGE_BATCH_MAX;
+
+	/* Keep the cport on its endpoints pair until the messages are sent */
+	pending = &es2->cports[cport_id].out_pending;
+	atomic_add(count, pending);
+	smp_mb__after_atomic();
+
+	es2_agg_flush_now(&es2->cport_out[cport_to_ep_pair(es2, cport_id)]);
+
+	/* A batch is made of requests of a single connection */
+	n = next_free_urbs(es2, out_urbs, count,
+				messages[0]->operation->priority, gfp_mask);
+	if (!n) {
+		atomic_sub(count, pending);
 		return -ENOMEM;
+	}
 
-	spin_lock_irqsave(&es2->cport_out_urb_lock, flags);
-	message->hcpriv = urb;
-	spin_unlock_irqrestore(&es2->cport_out_urb_lock, flags);
+	for (i = 0; i < n; i++)
+		WRITE_ONCE(messages[i]->hcpriv, out_urbs[i]);
 
-	/* Pack the cport id into the message header */
-	gb_message_cport_pack(message->header, cport_id);
+	for (i = 0; i < n; i++) {
+		retval = message_submit(es2, cport_id, messages[i],
+					out_urbs[i], gfp_mask);
+		if (retval)
+			break;
+	}
 
-	buffer_size = sizeof(*message->header) + message->payload_size;
+	/* Release the urbs of any messages we did not get to */
+	for (j = i + 1; j < n; j++) {
+		WRITE_ONCE(messages[j]->hcpriv, NULL);
+		free_urb(es2, out_urbs[j]);
+	}
+	atomic_sub(count - i, pending);
 
-	ep_pair = cport_to_ep_pair(es2, cport_id);
-	usb_fill_bulk_urb(urb, udev,
-			  usb_sndbulkpipe(udev,
-					  es2->cport_out[ep_pair].endpoint),
-			  message->buffer, buffer_size,
-			  cport_out_callback, message);
-	urb->transfer_flags |= URB_ZERO_PACKET;
-	trace_gb_host_device_send(hd, cport_id, buffer_size);
-	retval = usb_submit_urb(urb, gfp_mask);
-	if (retval) {
-		dev_err(&udev->dev, "failed to submit out-urb: %d\n", retval);
+	return i ? i : retval;
+}
+
+/*
+ * Take a message out of the transfer being aggregated on its endpoint, if
+ * it has not been submitted yet.  The endpoint of the CPort may have been
+ * remapped since the message was queued, so look at them all.
+ */
+static bool es2_agg_cancel(struct es2_ap_dev *es2, struct gb_message *message)
+{
+	struct es2_cport_out *cport_out;
+	bool removed;
+	int i;
 
-		spin_lock_irqsave(&es2->cport_out_urb_lock, flags);
-		message->hcpriv = NULL;
-		spin_unlock_irqrestore(&es2->cport_out_urb_lock, flags);
+	for (i = 0; i < NUM_BULKS; i++) {
+		cport_out = &es2->cport_out[i];
 
-		free_urb(es2, urb);
-		gb_message_cport_clear(message->header);
+		spin_lock_irq(&cport_out->agg_lock);
+		removed = es2_agg_remove(cport_out, message);
+		spin_unlock_irq(&cport_out->agg_lock);
 
-		return retval;
+		if (removed)
+			return true;
 	}
 
-	return 0;
+	return false;
+}
+
+/*
+ * Detach a message from the submitted aggregate transfer carrying it, for
+ * its completion not to be reported.  The transfer goes on for the other
+ * messages, and is only unlinked once all of them have been cancelled.
+ * The caller holds a reference to the urb, which keeps the transfer around.
+ *
+ * Returns false if the transfer has already completed, in which case the
+ * message is reported along with the others.
+ */
+static bool es2_agg_detach(struct es2_cport_out_urb *out_urb,
+				struct gb_message *message)
+{
+	struct es2_agg_transfer *agg = READ_ONCE(out_urb->agg);
+	bool detached = false;
+	bool unlink = false;
+	unsigned int i;
+
+	if (!agg)
+		return false;
+
+	spin_lock_irq(&agg->cport_out->agg_lock);
+	for (i = 0; i < agg->count && !agg->done; i++) {
+		if (agg->messages[i] == message) {
+			agg->messages[i] = NULL;
+			unlink = ++agg->cancelled == agg->count;
+			detached = true;
+			break;
+		}
+	}
+	spin_unlock_irq(&agg->cport_out->agg_lock);
+
+	if (!detached)
+		return false;
+
+	WRITE_ONCE(message->hcpriv, NULL);
+	if (unlink)
+		usb_unlink_urb(out_urb->urb);
+
+	return true;
 }
 
 /*
+ * Cancel a batch of messages.  All of their urbs are unlinked before we
+ * wait for any of them, so that they are killed in parallel.  Messages
+ * carried by an aggregate transfer are detached from it instead, leaving
+ * the transfer to the others.
+ *
  * Can not be called in atomic context.
  */
-static void message_cancel(struct gb_message *message)
+static void message_cancel_batch(struct gb_host_device *hd,
+			struct gb_message **messages, unsigned int count)
 {
-	struct gb_host_device *hd = message->operation->connection->hd;
 	struct es2_ap_dev *es2 = hd_to_es2(hd);
-	struct urb *urb;
-	int i;
+	struct es2_cport_out_urb *out_urbs[GB_HD_MESSAGE_BATCH_MAX];
+	unsigned int j;
 
 	might_sleep();
 
-	spin_lock_irq(&es2->cport_out_urb_lock);
-	urb = message->hcpriv;
+	if (WARN_ON(count > GB_HD_MESSAGE_BATCH_MAX))
+		count = GB_HD_MESSAGE_BATCH_MAX;
 
-	/* Prevent dynamically allocated urb from being deallocated. */
-	usb_get_urb(urb);
+	/*
+	 * Messages still being aggregated never reached the host controller.
+	 * The reference we hold to the urbs of the others prevents them from
+	 * being reused or freed until they have been killed.
+	 */
+	for (j = 0; j < count; j++) {
+		out_urbs[j] = NULL;
+		if (es2_agg_cancel(es2, messages[j])) {
+			es2_message_sent(hd, messages[j], -ENOENT);
+			continue;
+		}
 
-	/* Prevent pre-allocated urb from being reused. */
-	for (i = 0; i < NUM_CPORT_OUT_URB; ++i) {
-		if (urb == es2->cport_out_urb[i]) {
-			es2->cport_out_urb_cancelled[i] = true;
-			break;
+		out_urbs[j] = cport_out_urb_get_message(es2, messages[j]);
+		if (out_urbs[j] && es2_agg_detach(out_urbs[j], messages[j])) {
+			es2_message_sent(hd, messages[j], -ENOENT);
+			free_urb(es2, out_urbs[j]);
+			out_urbs[j] = NULL;
 		}
 	}
-	spin_unlock_irq(&es2->cport_out_urb_lock);
 
-	usb_kill_urb(urb);
+	for (j = 0; j < count; j++) {
+		if (out_urbs[j])
+			usb_unlink_urb(out_urbs[j]->urb);
+	}
+	for (j = 0; j < count; j++) {
+		if (out_urbs[j])
+			usb_kill_urb(out_urbs[j]->urb);
+	}
 
-	if (i < NUM_CPORT_OUT_URB) {
-		spin_lock_irq(&es2->cport_out_urb_lock);
-		es2->cport_out_urb_cancelled[i] = false;
-		spin_unlock_irq(&es2->cport_out_urb_lock);
+	for (j = 0; j < count; j++) {
+		if (out_urbs[j])
+			free_urb(es2, out_urbs[j]);
 	}
+}
 
-	usb_free_urb(urb);
+/*
+ * Can not be called in atomic context.
+ */
+static void message_cancel(struct gb_message *message)
+{
+	struct gb_host_device *hd = message->operation->connection->hd;
+
+	message_cancel_batch(hd, &message, 1);
 }
 
 static int cport_reset(struct gb_host_device *hd, u16 cport_id)
@@ -452,6 +1818,8 @@ static int cport_reset(struct gb_host_device *hd, u16 cport_id)
 
 static int cport_enable(struct gb_host_device *hd, u16 cport_id)
 {
+	struct es2_ap_dev *es2 = hd_to_es2(hd);
+	struct es2_cport *cport;
 	int retval;
 
 	if (cport_id != GB_SVC_CPORT_ID) {
@@ -460,6 +1828,36 @@ static int cport_enable(struct gb_host_device *hd, u16 cport_id)
 			return retval;
 	}
 
+	if (cport_id_valid(hd, cport_id)) {
+		cport = &es2->cports[cport_id];
+
+		mutex_lock(&es2->ep_lock);
+		cport->last_bytes = atomic64_read(&cport->bytes);
+		cport->rate = 0;
+		cport->enabled = true;
+		cport->unordered = greybus_cport_unordered(hd, cport_id);
+		mutex_unlock(&es2->ep_lock);
+	}
+
+	return 0;
+}
+
+static int cport_disable(struct gb_host_device *hd, u16 cport_id)
+{
+	struct es2_ap_dev *es2 = hd_to_es2(hd);
+
+	if (!cport_id_valid(hd, cport_id))
+		return 0;
+
+	/* Hand the endpoints pair of the cport back */
+	mutex_lock(&es2->ep_lock);
+	es2->cports[cport_id].enabled = false;
+	if (es2->cport_to_ep[cport_id]) {
+		if (unmap_cport(es2, cport_id))
+			WRITE_ONCE(es2->cport_to_ep[cport_id], 0);
+	}
+	mutex_unlock(&es2->ep_lock);
+
 	return 0;
 }
 
@@ -514,8 +1912,12 @@ static int latency_tag_disable(struct gb_host_device *hd, u16 cport_id)
 static struct gb_hd_driver es2_driver = {
 	.hd_priv_size		= sizeof(struct es2_ap_dev),
 	.message_send		= message_send,
+	.message_send_batch	= message_send_batch,
 	.message_cancel		= message_cancel,
+	.message_cancel_batch	= message_cancel_batch,
+	.rx_buffer_release	= rx_buffer_release,
 	.cport_enable		= cport_enable,
+	.cport_disable		= cport_disable,
 	.latency_tag_enable	= latency_tag_enable,
 	.latency_tag_disable	= latency_tag_disable,
 };
@@ -555,33 +1957,48 @@ static void es2_destroy(struct es2_ap_dev *es2)
 	debugfs_remove(es2->apb_log_enable_dentry);
 	usb_log_disable(es2);
 
+	/* Every message has been cancelled by now */
+	for (i = 0; i < NUM_BULKS; ++i) {
+		struct es2_cport_out *cport_out = &es2->cport_out[i];
+
+		hrtimer_cancel(&cport_out->agg_timer);
+		kfree(cport_out->agg);
+		kfree(cport_out->agg_spare);
+	}
+
 	/* Tear down everything! */
 	for (i = 0; i < NUM_CPORT_OUT_URB; ++i) {
-		struct urb *urb = es2->cport_out_urb[i];
+		struct urb *urb = es2->cport_out_urb[i].urb;
 
 		if (!urb)
 			break;
 		usb_kill_urb(urb);
 		usb_free_urb(urb);
-		es2->cport_out_urb[i] = NULL;
-		es2->cport_out_urb_busy[i] = false;	/* just to be anal */
+		es2->cport_out_urb[i].urb = NULL;
 	}
 
+	/* Wait for dynamically allocated urbs to be freed */
+	rcu_barrier();
+
 	for (bulk_in = 0; bulk_in < NUM_BULKS; bulk_in++) {
 		struct es2_cport_in *cport_in = &es2->cport_in[bulk_in];
 
-		for (i = 0; i < NUM_CPORT_IN_URB; ++i) {
-			struct urb *urb = cport_in->urb[i];
-
-			if (!urb)
-				break;
-			usb_free_urb(urb);
-			kfree(cport_in->buffer[i]);
-			cport_in->buffer[i] = NULL;
+		for (i = 0; i < cport_in->urb_count; ++i) {
+			cport_in_urb_free(cport_in->urb[i]);
+			cport_in->urb[i] = NULL;
 		}
+		cport_in->urb_count = 0;
+	}
+
+	while (!list_empty(&es2->cport_in_spare)) {
+		struct list_head *entry = es2->cport_in_spare.next;
+
+		list_del(entry);
+		kfree(entry);
 	}
 
 	kfree(es2->cport_to_ep);
+	kfree(es2->cports);
 
 	udev = es2->usb_dev;
 	gb_hd_put(es2->hd);
@@ -594,74 +2011,296 @@ static void ap_disconnect(struct usb_interface *interface)
 	struct es2_ap_dev *es2 = usb_get_intfdata(interface);
 	int i;
 
+	mutex_lock(&es2->ep_lock);
+	es2->ep_balance_enabled = false;
+	mutex_unlock(&es2->ep_lock);
+
+	cancel_delayed_work_sync(&es2->ep_balance_work);
+
+	mutex_lock(&es2->cport_in_lock);
+	es2->cport_in_enabled = false;
 	for (i = 0; i < NUM_BULKS; ++i)
 		es2_cport_in_disable(es2, &es2->cport_in[i]);
+	mutex_unlock(&es2->cport_in_lock);
+
+	cancel_delayed_work_sync(&es2->cport_in_scale_work);
+	for (i = 0; i < NUM_BULKS; ++i)
+		cancel_work_sync(&es2->cport_in[i].rx_work);
 
 	gb_hd_del(es2->hd);
 
 	es2_destroy(es2);
 }
 
-static void cport_in_callback(struct urb *urb)
+/*
+ * Pass received data to the greybus core, lending it the urb buffer if we
+ * have a spare one to resubmit the urb with.
+ */
+static void cport_in_data_rcvd(struct gb_host_device *hd, struct urb *urb,
+				u16 cport_id)
+{
+	struct es2_ap_dev *es2 = hd_to_es2(hd);
+	u8 *buffer = urb->transfer_buffer;
+	u8 *spare;
+
+	spare = cport_in_spare_get(es2);
+	if (!spare) {
+		greybus_data_rcvd(hd, cport_id, buffer, urb->actual_length);
+		return;
+	}
+
+	if (greybus_data_rcvd_buffer(hd, cport_id, buffer, urb->actual_length,
+					buffer))
+		urb->transfer_buffer = spare;
+	else
+		cport_in_spare_put(es2, spare);
+}
+
+/*
+ * Pass each of the messages of a transfer carrying several of them to the
+ * greybus core.  They are copied, as the buffer can't be lent more than
+ * once.
+ *
+ * Returns the number of messages found in the transfer.
+ */
+static unsigned int cport_in_split(struct gb_host_device *hd, struct urb *urb)
 {
-	struct gb_host_device *hd = urb->context;
 	struct device *dev = &urb->dev->dev;
 	struct gb_operation_msg_hdr *header;
-	int status = check_urb_status(urb);
-	int retval;
+	u8 *buffer = urb->transfer_buffer;
+	size_t left = urb->actual_length;
+	unsigned int count = 0;
+	size_t size;
 	u16 cport_id;
 
-	if (status) {
-		if ((status == -EAGAIN) || (status == -EPROTO))
-			goto exit;
-		dev_err(dev, "urb cport in error %d (dropped)\n", status);
-		return;
+	while (left >= sizeof(*header)) {
+		header = (struct gb_operation_msg_hdr *)buffer;
+		size = le16_to_cpu(header->size);
+		if (size < sizeof(*header) || size > left) {
+			dev_err(dev, "bad message size %zu in transfer\n",
+				size);
+			break;
+		}
+
+		cport_id = gb_message_cport_unpack(header);
+		if (cport_id_valid(hd, cport_id)) {
+			trace_gb_host_device_recv(hd, cport_id, size);
+			cport_account(hd_to_es2(hd), cport_id, size);
+			greybus_data_rcvd(hd, cport_id, buffer, size);
+		} else {
+			dev_err(dev, "invalid cport id 0x%02x received\n",
+				cport_id);
+		}
+
+		buffer += size;
+		left -= size;
+		count++;
+	}
+
+	return count;
+}
+
+/* Put an urb back in the request pool */
+static void cport_in_resubmit(struct es2_cport_in *cport_in, struct urb *urb,
+				gfp_t gfp_mask)
+{
+	int retval;
+
+	atomic_inc(&cport_in->in_flight);
+	retval = usb_submit_urb(urb, gfp_mask);
+	if (retval) {
+		atomic_dec(&cport_in->in_flight);
+		/* The urb is being stopped if it was poisoned */
+		if (retval != -EPERM) {
+			dev_err(&urb->dev->dev,
+				"failed to resubmit in-urb: %d\n", retval);
+		}
 	}
+}
+
+/*
+ * Hand the messages of a received transfer to the greybus core.
+ *
+ * Returns the number of messages the transfer carried.
+ */
+static unsigned int cport_in_process(struct es2_cport_in *cport_in,
+					struct urb *urb)
+{
+	struct es2_ap_dev *es2 = cport_in->es2;
+	struct gb_host_device *hd = es2->hd;
+	struct device *dev = &urb->dev->dev;
+	struct gb_operation_msg_hdr *header;
+	unsigned int count = 1;
+	u16 cport_id;
+
+	atomic64_inc(&cport_in->completions);
 
 	if (urb->actual_length < sizeof(*header)) {
 		dev_err(dev, "short message received\n");
-		goto exit;
+		return 0;
 	}
 
-	/* Extract the CPort id, which is packed in the message header */
+	atomic64_inc(&es2->in_transfers);
+
+	/*
+	 * With aggregation enabled, the transfer may carry several messages
+	 * back to back.  Otherwise any trailing bytes are ignored, as ever.
+	 */
 	header = urb->transfer_buffer;
+	if (READ_ONCE(es2->agg_delay_us) &&
+	    le16_to_cpu(header->size) < urb->actual_length) {
+		count = cport_in_split(hd, urb);
+		atomic64_add(count, &es2->in_messages);
+		return count;
+	}
+	atomic64_inc(&es2->in_messages);
+
+	/* Extract the CPort id, which is packed in the message header */
 	cport_id = gb_message_cport_unpack(header);
 
 	if (cport_id_valid(hd, cport_id)) {
 		trace_gb_host_device_recv(hd, cport_id, urb->actual_length);
-		greybus_data_rcvd(hd, cport_id, urb->transfer_buffer,
-							urb->actual_length);
+		cport_account(es2, cport_id, urb->actual_length);
+		cport_in_data_rcvd(hd, urb, cport_id);
 	} else {
 		dev_err(dev, "invalid cport id 0x%02x received\n", cport_id);
 	}
+
+	return count;
+}
+
+static void cport_in_poll_schedule(struct es2_cport_in *cport_in)
+{
+	int cpu = READ_ONCE(cport_in->rx_cpu);
+
+	if (cpu < 0 || !cpu_online(cpu))
+		cpu = WORK_CPU_UNBOUND;
+
+	queue_work_on(cpu, system_highpri_wq, &cport_in->rx_work);
+}
+
+/*
+ * Poll the received transfers of an endpoint, processing up to a budget
+ * of messages.  The urbs are resubmitted together once processed, and the
+ * poller requeues itself if there are transfers left, so that other work
+ * gets to run on the CPU.
+ */
+static void cport_in_poll(struct work_struct *work)
+{
+	struct es2_cport_in *cport_in;
+	struct urb *urb, *tmp;
+	unsigned int budget;
+	unsigned int count = 0;
+	LIST_HEAD(done);
+	bool more;
+
+	cport_in = container_of(work, struct es2_cport_in, rx_work);
+	budget = READ_ONCE(cport_in->es2->rx_poll_budget);
+
+	mutex_lock(&cport_in->rx_mutex);
+	while (!budget || count < budget) {
+		spin_lock_irq(&cport_in->rx_lock);
+		if (list_empty(&cport_in->rx_list)) {
+			spin_unlock_irq(&cport_in->rx_lock);
+			break;
+		}
+		urb = list_first_entry(&cport_in->rx_list, struct urb,
+					urb_list);
+		list_move_tail(&urb->urb_list, &done);
+		spin_unlock_irq(&cport_in->rx_lock);
+
+		count += cport_in_process(cport_in, urb);
+	}
+
+	list_for_each_entry_safe(urb, tmp, &done, urb_list) {
+		list_del_init(&urb->urb_list);
+		cport_in_resubmit(cport_in, urb, GFP_KERNEL);
+	}
+
+	spin_lock_irq(&cport_in->rx_lock);
+	more = !list_empty(&cport_in->rx_list);
+	spin_unlock_irq(&cport_in->rx_lock);
+	mutex_unlock(&cport_in->rx_mutex);
+
+	if (more)
+		cport_in_poll_schedule(cport_in);
+}
+
+static void cport_in_callback(struct urb *urb)
+{
+	struct es2_cport_in *cport_in = urb->context;
+	struct es2_ap_dev *es2 = cport_in->es2;
+	struct device *dev = &urb->dev->dev;
+	int status = check_urb_status(urb);
+	unsigned long flags;
+
+	/* Count the times the host controller was left without urbs */
+	if (atomic_dec_and_test(&cport_in->in_flight) && !status)
+		atomic64_inc(&cport_in->ring_empty);
+
+	if (status) {
+		if ((status == -EAGAIN) || (status == -EPROTO))
+			goto exit;
+		dev_err(dev, "urb cport in error %d (dropped)\n", status);
+		return;
+	}
+
+	/* Leave the transfer to the poller, which resubmits the urb */
+	if (es2->rx_poll) {
+		spin_lock_irqsave(&cport_in->rx_lock, flags);
+		list_add_tail(&urb->urb_list, &cport_in->rx_list);
+		spin_unlock_irqrestore(&cport_in->rx_lock, flags);
+
+		cport_in_poll_schedule(cport_in);
+		return;
+	}
+
+	cport_in_process(cport_in, urb);
 exit:
-	/* put our urb back in the request pool */
-	retval = usb_submit_urb(urb, GFP_ATOMIC);
-	if (retval)
-		dev_err(dev, "failed to resubmit in-urb: %d\n", retval);
+	cport_in_resubmit(cport_in, urb, GFP_ATOMIC);
 }
 
 static void cport_out_callback(struct urb *urb)
 {
-	struct gb_message *message = urb->context;
+	struct es2_cport_out_urb *out_urb = urb->context;
+	struct gb_message *message = out_urb->context;
 	struct gb_host_device *hd = message->operation->connection->hd;
 	struct es2_ap_dev *es2 = hd_to_es2(hd);
 	int status = check_urb_status(urb);
-	unsigned long flags;
 
 	gb_message_cport_clear(message->header);
 
-	spin_lock_irqsave(&es2->cport_out_urb_lock, flags);
-	message->hcpriv = NULL;
-	spin_unlock_irqrestore(&es2->cport_out_urb_lock, flags);
+	WRITE_ONCE(message->hcpriv, NULL);
 
 	/*
 	 * Tell the submitter that the message send (attempt) is
 	 * complete, and report the status.
 	 */
-	greybus_message_sent(hd, message, status);
+	es2_message_sent(hd, message, status);
+
+	message_sg_free(urb);
+	free_urb(es2, out_urb);
+}
+
+static void cport_out_agg_callback(struct urb *urb)
+{
+	struct es2_cport_out_urb *out_urb = urb->context;
+	struct es2_agg_transfer *agg = out_urb->agg;
+	int status = check_urb_status(urb);
+	unsigned long flags;
+	unsigned int i;
+
+	/* Messages cancelled from now on are reported here */
+	spin_lock_irqsave(&agg->cport_out->agg_lock, flags);
+	agg->done = true;
+	spin_unlock_irqrestore(&agg->cport_out->agg_lock, flags);
 
-	free_urb(es2, urb);
+	for (i = 0; i < agg->count; i++) {
+		if (agg->messages[i])
+			WRITE_ONCE(agg->messages[i]->hcpriv, NULL);
+	}
+
+	es2_agg_complete(agg, status);
 }
 
 #define APB1_LOG_MSG_SIZE	64
@@ -792,6 +2431,46 @@ static const struct file_operations apb_log_enable_fops = {
 	.write	= apb_log_enable_write,
 };
 
+static void aggregation_show_stats(struct seq_file *s, const char *name,
+				atomic64_t *transfers, atomic64_t *messages)
+{
+	u64 count = atomic64_read(transfers);
+	u64 factor = 0;
+
+	/* Average number of messages per transfer, in hundredths */
+	if (count)
+		factor = div64_u64(atomic64_read(messages) * 100, count);
+
+	seq_printf(s, "%s\t%llu\t%llu\t%llu.%02llu\n", name, count,
+			(u64)atomic64_read(messages), factor / 100,
+			factor % 100);
+}
+
+static int aggregation_show(struct seq_file *s, void *unused)
+{
+	struct es2_ap_dev *es2 = s->private;
+
+	seq_puts(s, "dir\ttransfers\tmessages\tfactor\n");
+	aggregation_show_stats(s, "out", &es2->out_transfers,
+				&es2->out_messages);
+	aggregation_show_stats(s, "in", &es2->in_transfers,
+				&es2->in_messages);
+
+	return 0;
+}
+
+static int aggregation_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, aggregation_show, inode->i_private);
+}
+
+static const struct file_operations aggregation_fops = {
+	.open		= aggregation_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 static int apb_get_cport_count(struct usb_device *udev)
 {
 	int retval;
@@ -866,7 +2545,49 @@ static int ap_probe(struct usb_interface *interface,
 	es2->hd = hd;
 	es2->usb_intf = interface;
 	es2->usb_dev = udev;
-	spin_lock_init(&es2->cport_out_urb_lock);
+
+#ifdef USB_HAVE_NO_SG_CONSTRAINT
+	/*
+	 * Messages with scatterlist payloads can be sent without copying if
+	 * the host controller takes entries of arbitrary length.
+	 */
+	if (udev->bus->no_sg_constraint)
+		hd->sg_tablesize = udev->bus->sg_tablesize;
+#endif
+	for (i = 0; i < NUM_BULKS; ++i) {
+		struct es2_cport_out *cport_out = &es2->cport_out[i];
+
+		cport_out->es2 = es2;
+		spin_lock_init(&cport_out->agg_lock);
+		hrtimer_init(&cport_out->agg_timer, CLOCK_MONOTONIC,
+				HRTIMER_MODE_REL);
+		cport_out->agg_timer.function = es2_agg_timer;
+	}
+	INIT_LIST_HEAD(&es2->cport_in_spare);
+	spin_lock_init(&es2->cport_in_spare_lock);
+	mutex_init(&es2->cport_in_lock);
+	INIT_DELAYED_WORK(&es2->cport_in_scale_work, es2_cport_in_scale_work);
+	es2->cport_in_depth = clamp_t(unsigned int, cport_in_urbs, 1,
+					ES2_CPORT_IN_URB_MAX);
+	es2->cport_in_size = clamp_t(size_t, cport_in_size,
+					ES2_GBUF_MSG_SIZE_MAX,
+					ES2_CPORT_IN_SIZE_MAX);
+	es2->cport_in_autoscale = cport_in_autoscale;
+	for (i = 0; i < NUM_BULKS; ++i) {
+		struct es2_cport_in *cport_in = &es2->cport_in[i];
+
+		cport_in->es2 = es2;
+		INIT_LIST_HEAD(&cport_in->rx_list);
+		spin_lock_init(&cport_in->rx_lock);
+		mutex_init(&cport_in->rx_mutex);
+		INIT_WORK(&cport_in->rx_work, cport_in_poll);
+	}
+	es2->rx_poll = rx_poll;
+	es2->rx_poll_budget = ES2_RX_POLL_BUDGET;
+	es2_rx_cpu_set(es2, rx_poll_cpu < (int)nr_cpu_ids ? rx_poll_cpu : -1);
+	mutex_init(&es2->ep_lock);
+	INIT_DELAYED_WORK(&es2->ep_balance_work, es2_ep_balance_work);
+	es2->ep_balance_min_bytes = ES2_EP_BALANCE_MIN_BYTES;
 	INIT_KFIFO(es2->apb_log_fifo);
 	usb_set_intfdata(interface, es2);
 
@@ -877,6 +2598,13 @@ static int ap_probe(struct usb_interface *interface,
 		goto error;
 	}
 
+	es2->cports = kcalloc(hd->num_cports, sizeof(*es2->cports),
+				GFP_KERNEL);
+	if (!es2->cports) {
+		retval = -ENOMEM;
+		goto error;
+	}
+
 	/* find all bulk endpoints */
 	iface_desc = interface->cur_altsetting;
 	for (i = 0; i < iface_desc->desc.bNumEndpoints; ++i) {
@@ -900,28 +2628,26 @@ static int ap_probe(struct usb_interface *interface,
 	}
 
 	/* Allocate buffers for our cport in messages */
+	mutex_lock(&es2->cport_in_lock);
 	for (bulk_in = 0; bulk_in < NUM_BULKS; bulk_in++) {
-		struct es2_cport_in *cport_in = &es2->cport_in[bulk_in];
+		retval = es2_cport_in_resize(es2, &es2->cport_in[bulk_in],
+						es2->cport_in_depth);
+		if (retval)
+			break;
+	}
+	mutex_unlock(&es2->cport_in_lock);
+	if (retval)
+		goto error;
+	retval = -ENOMEM;
 
-		for (i = 0; i < NUM_CPORT_IN_URB; ++i) {
-			struct urb *urb;
-			u8 *buffer;
-
-			urb = usb_alloc_urb(0, GFP_KERNEL);
-			if (!urb)
-				goto error;
-			buffer = kmalloc(ES2_GBUF_MSG_SIZE_MAX, GFP_KERNEL);
-			if (!buffer)
-				goto error;
-
-			usb_fill_bulk_urb(urb, udev,
-					  usb_rcvbulkpipe(udev,
-							  cport_in->endpoint),
-					  buffer, ES2_GBUF_MSG_SIZE_MAX,
-					  cport_in_callback, hd);
-			cport_in->urb[i] = urb;
-			cport_in->buffer[i] = buffer;
-		}
+	/* Allocate spare buffers for our cport in messages */
+	for (i = 0; i < NUM_CPORT_IN_SPARE_BUF * NUM_BULKS; ++i) {
+		u8 *buffer;
+
+		buffer = kmalloc(es2->cport_in_size, GFP_KERNEL);
+		if (!buffer)
+			goto error;
+		cport_in_spare_put(es2, buffer);
 	}
 
 	/* Allocate urbs for our CPort OUT messages */
@@ -932,9 +2658,11 @@ static int ap_probe(struct usb_interface *interface,
 		if (!urb)
 			goto error;
 
-		es2->cport_out_urb[i] = urb;
-		es2->cport_out_urb_busy[i] = false;	/* just to be anal */
+		es2->cport_out_urb[i].urb = urb;
+		es2->cport_out_urb[i].index = i;
+		set_bit(i, es2->cport_out_urb_map);
 	}
+	atomic_set(&es2->cport_out_urb_free, NUM_CPORT_OUT_URB);
 
 	/* XXX We will need to rename this per APB */
 	es2->apb_log_enable_dentry = debugfs_create_file("apb_log_enable",
@@ -946,17 +2674,57 @@ static int ap_probe(struct usb_interface *interface,
 	if (retval)
 		goto error;
 
+	/* Aggregation needs support from the firmware, so it's off by default */
+	debugfs_create_u32("aggregate_delay_us", S_IRUGO | S_IWUSR,
+				hd->debugfs_dentry, &es2->agg_delay_us);
+	debugfs_create_file("aggregation", S_IRUGO, hd->debugfs_dentry, es2,
+				&aggregation_fops);
+	debugfs_create_file("cport_in_urbs", S_IRUGO | S_IWUSR,
+				hd->debugfs_dentry, es2, &cport_in_urbs_fops);
+	debugfs_create_file("cport_in_autoscale", S_IRUGO | S_IWUSR,
+				hd->debugfs_dentry, es2,
+				&cport_in_autoscale_fops);
+	debugfs_create_file("cport_in", S_IRUGO, hd->debugfs_dentry, es2,
+				&cport_in_fops);
+	debugfs_create_u32("rx_poll_budget", S_IRUGO | S_IWUSR,
+				hd->debugfs_dentry, &es2->rx_poll_budget);
+	debugfs_create_file("rx_poll_cpu", S_IRUGO | S_IWUSR,
+				hd->debugfs_dentry, es2, &rx_poll_cpu_fops);
+	debugfs_create_file("ep_balance_interval_ms", S_IRUGO | S_IWUSR,
+				hd->debugfs_dentry, es2,
+				&ep_balance_interval_fops);
+	debugfs_create_u32("ep_balance_min_bytes", S_IRUGO | S_IWUSR,
+				hd->debugfs_dentry, &es2->ep_balance_min_bytes);
+	debugfs_create_file("ep_mapping", S_IRUGO, hd->debugfs_dentry, es2,
+				&ep_mapping_fops);
+
+	mutex_lock(&es2->cport_in_lock);
 	for (i = 0; i < NUM_BULKS; ++i) {
 		retval = es2_cport_in_enable(es2, &es2->cport_in[i]);
 		if (retval)
 			goto err_disable_cport_in;
 	}
+	es2->cport_in_enabled = true;
+	if (es2->cport_in_autoscale) {
+		schedule_delayed_work(&es2->cport_in_scale_work,
+					ES2_CPORT_IN_SCALE_INTERVAL);
+	}
+	mutex_unlock(&es2->cport_in_lock);
+
+	mutex_lock(&es2->ep_lock);
+	es2->ep_balance_enabled = true;
+	if (es2->ep_balance_interval_ms) {
+		schedule_delayed_work(&es2->ep_balance_work,
+				msecs_to_jiffies(es2->ep_balance_interval_ms));
+	}
+	mutex_unlock(&es2->ep_lock);
 
 	return 0;
 
 err_disable_cport_in:
 	for (--i; i >= 0; --i)
 		es2_cport_in_disable(es2, &es2->cport_in[i]);
+	mutex_unlock(&es2->cport_in_lock);
 	gb_hd_del(hd);
 error:
 	es2_destroy(es2);
@@ -17,6 +17,9 @@
 
 #include "greybus.h"
 
+/* Number of operations preallocated for get and set value requests */
+#define GB_GPIO_OP_POOL_SIZE	4
+
 struct gb_gpio_line {
 	/* The following has to be an array of line_max entries */
 	/* --> make them just a flags field */
@@ -44,6 +47,7 @@ struct gb_gpio_controller {
 	irq_flow_handler_t	irq_handler;
 	unsigned int		irq_default_type;
 	struct mutex		irq_lock;
+	struct gb_operation_small *irq_op;	/* protected by irq_lock */
 };
 #define gpio_chip_to_gb_gpio_controller(chip) \
 	container_of(chip, struct gb_gpio_controller, chip)
@@ -155,9 +159,11 @@ static int gb_gpio_get_value_operation(struct gb_gpio_controller *ggc,
 	u8 value;
 
 	request.which = which;
-	ret = gb_operation_sync(ggc->connection, GB_GPIO_TYPE_GET_VALUE,
-				&request, sizeof(request),
-				&response, sizeof(response));
+	ret = gb_operation_sync_timeout(ggc->connection,
+					GB_GPIO_TYPE_GET_VALUE,
+					&request, sizeof(request),
+					&response, sizeof(response),
+					GB_OPERATION_TIMEOUT_ADAPTIVE);
 	if (ret) {
 		dev_err(ggc->chip.dev, "failed to get value of gpio %u\n",
 			which);
@@ -188,8 +194,10 @@ static void gb_gpio_set_value_operation(struct gb_gpio_controller *ggc,
 
 	request.which = which;
 	request.value = value_high ? 1 : 0;
-	ret = gb_operation_sync(ggc->connection, GB_GPIO_TYPE_SET_VALUE,
-				&request, sizeof(request), NULL, 0);
+	ret = gb_operation_sync_timeout(ggc->connection,
+					GB_GPIO_TYPE_SET_VALUE,
+					&request, sizeof(request), NULL, 0,
+					GB_OPERATION_TIMEOUT_ADAPTIVE);
 	if (ret) {
 		dev_err(ggc->chip.dev, "failed to set value of gpio %u\n",
 			which);
@@ -220,9 +228,10 @@ static void _gb_gpio_irq_mask(struct gb_gpio_controller *ggc, u8 hwirq)
 	int ret;
 
 	request.which = hwirq;
-	ret = gb_operation_sync(ggc->connection,
+	ret = gb_operation_sync_small(ggc->irq_op, ggc->connection,
 				GB_GPIO_TYPE_IRQ_MASK,
-				&request, sizeof(request), NULL, 0);
+				&request, sizeof(request), NULL, 0,
+				GB_OPERATION_TIMEOUT_DEFAULT);
 	if (ret)
 		dev_err(ggc->chip.dev, "failed to mask irq: %d\n", ret);
 }
@@ -233,9 +242,10 @@ static void _gb_gpio_irq_unmask(struct gb_gpio_controller *ggc, u8 hwirq)
 	int ret;
 
 	request.which = hwirq;
-	ret = gb_operation_sync(ggc->connection,
+	ret = gb_operation_sync_small(ggc->irq_op, ggc->connection,
 				GB_GPIO_TYPE_IRQ_UNMASK,
-				&request, sizeof(request), NULL, 0);
+				&request, sizeof(request), NULL, 0,
+				GB_OPERATION_TIMEOUT_DEFAULT);
 	if (ret)
 		dev_err(ggc->chip.dev, "failed to unmask irq: %d\n", ret);
 }
@@ -249,9 +259,10 @@ static void _gb_gpio_irq_set_type(struct gb_gpio_controller *ggc,
 	request.which = hwirq;
 	request.type = type;
 
-	ret = gb_operation_sync(ggc->connection,
+	ret = gb_operation_sync_small(ggc->irq_op, ggc->connection,
 				GB_GPIO_TYPE_IRQ_TYPE,
-				&request, sizeof(request), NULL, 0);
+				&request, sizeof(request), NULL, 0,
+				GB_OPERATION_TIMEOUT_DEFAULT);
 	if (ret)
 		dev_err(ggc->chip.dev, "failed to set irq type: %d\n", ret);
 }
@@ -630,11 +641,30 @@ static int gb_gpio_connection_init(struct gb_connection *connection)
 		return -ENOMEM;
 	ggc->connection = connection;
 	connection->private = ggc;
+	connection->priority = GB_OPERATION_PRIORITY_HIGH;
 
-	ret = gb_gpio_controller_setup(ggc);
+	/*
+	 * Line values are read and written at a high rate, so serve their
+	 * requests (and any other that fits) from preallocated operations.
+	 * The pool is destroyed by the core.
+	 */
+	ret = gb_operation_pool_create(connection, GB_GPIO_OP_POOL_SIZE,
+				sizeof(struct gb_gpio_set_value_request),
+				sizeof(struct gb_gpio_get_value_response));
 	if (ret)
 		goto err_free_controller;
 
+	/* Irq requests are serialised by the bus lock, and share storage */
+	ggc->irq_op = kzalloc(sizeof(*ggc->irq_op), GFP_KERNEL);
+	if (!ggc->irq_op) {
+		ret = -ENOMEM;
+		goto err_free_controller;
+	}
+
+	ret = gb_gpio_controller_setup(ggc);
+	if (ret)
+		goto err_free_irq_op;
+
 	irqc = &ggc->irqc;
 	irqc->irq_mask = gb_gpio_irq_mask;
 	irqc->irq_unmask = gb_gpio_irq_unmask;
@@ -685,6 +715,8 @@ irqchip_err:
 	gb_gpiochip_remove(gpio);
 err_free_lines:
 	kfree(ggc->lines);
+err_free_irq_op:
+	kfree(ggc->irq_op);
 err_free_controller:
 	kfree(ggc);
 	return ret;
@@ -701,6 +733,7 @@ static void gb_gpio_connection_exit(struct gb_connection *connection)
 	gb_gpiochip_remove(&ggc->chip);
 	/* kref_put(ggc->connection) */
 	kfree(ggc->lines);
+	kfree(ggc->irq_op);
 	kfree(ggc);
 }
 
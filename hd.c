@@ -11,6 +11,9 @@
 
 #include <linux/kernel.h>
 #include <linux/slab.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/workqueue.h>
 
 #include "greybus.h"
 
@@ -21,6 +24,8 @@ static void gb_hd_release(struct device *dev)
 {
 	struct gb_host_device *hd = to_gb_host_device(dev);
 
+	gb_operation_timeouts_exit(hd);
+	destroy_workqueue(hd->completion_wq);
 	ida_simple_remove(&gb_hd_bus_id_map, hd->bus_id);
 	ida_destroy(&hd->cport_id_map);
 	kfree(hd);
@@ -87,12 +92,21 @@ struct gb_host_device *gb_hd_create(struct gb_hd_driver *driver,
 	hd->bus_id = ret;
 	dev_set_name(&hd->dev, "greybus%d", hd->bus_id);
 
+	hd->completion_wq = alloc_workqueue("%s_completion", 0, 0,
+						dev_name(&hd->dev));
+	if (!hd->completion_wq) {
+		ida_simple_remove(&gb_hd_bus_id_map, hd->bus_id);
+		kfree(hd);
+		return ERR_PTR(-ENOMEM);
+	}
+
 	hd->driver = driver;
 	INIT_LIST_HEAD(&hd->interfaces);
 	INIT_LIST_HEAD(&hd->connections);
 	ida_init(&hd->cport_id_map);
 	hd->buffer_size_max = buffer_size_max;
 	hd->num_cports = num_cports;
+	gb_operation_timeouts_init(hd);
 
 	return hd;
 }
@@ -110,6 +124,74 @@ static int gb_hd_create_svc_connection(struct gb_host_device *hd)
 	return 0;
 }
 
+/* Record a latency sample, in microseconds */
+void gb_hd_latency_add(struct gb_hd_latency_stats *stats, s64 us)
+{
+	int max;
+	int prev;
+
+	us = clamp_val(us, 0, INT_MAX);
+
+	atomic64_inc(&stats->count);
+	atomic64_add(us, &stats->total_us);
+
+	max = atomic_read(&stats->max_us);
+	while (us > max) {
+		prev = atomic_cmpxchg(&stats->max_us, max, us);
+		if (prev == max)
+			break;
+		max = prev;
+	}
+}
+
+static void gb_hd_latency_show_stats(struct seq_file *s, const char *name,
+					struct gb_hd_latency_stats *stats)
+{
+	u64 count = atomic64_read(&stats->count);
+	u64 avg = 0;
+
+	if (count)
+		avg = div64_u64(atomic64_read(&stats->total_us), count);
+
+	seq_printf(s, "%s\t%llu\t%llu\t%d\n", name, count, avg,
+			atomic_read(&stats->max_us));
+}
+
+static const char * const gb_hd_priority_names[] = {
+	[GB_OPERATION_PRIORITY_HIGH]	= "high",
+	[GB_OPERATION_PRIORITY_NORMAL]	= "normal",
+	[GB_OPERATION_PRIORITY_LOW]	= "low",
+};
+
+static int gb_hd_latency_show(struct seq_file *s, void *unused)
+{
+	struct gb_host_device *hd = s->private;
+	int i;
+
+	seq_puts(s, "class\tcount\tavg_us\tmax_us\n");
+	for (i = 0; i < GB_OPERATION_PRIORITY_COUNT; i++) {
+		gb_hd_latency_show_stats(s, gb_hd_priority_names[i],
+						&hd->latency[i]);
+	}
+
+	/* Time taken to tear down a connection, e.g. on hot-unplug */
+	gb_hd_latency_show_stats(s, "teardown", &hd->teardown);
+
+	return 0;
+}
+
+static int gb_hd_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, gb_hd_latency_show, inode->i_private);
+}
+
+static const struct file_operations gb_hd_latency_fops = {
+	.open		= gb_hd_latency_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 int gb_hd_add(struct gb_host_device *hd)
 {
 	int ret;
@@ -118,8 +200,14 @@ int gb_hd_add(struct gb_host_device *hd)
 	if (ret)
 		return ret;
 
+	hd->debugfs_dentry = debugfs_create_dir(dev_name(&hd->dev),
+						gb_debugfs_get());
+	debugfs_create_file("latency", S_IRUGO, hd->debugfs_dentry, hd,
+				&gb_hd_latency_fops);
+
 	ret = gb_hd_create_svc_connection(hd);
 	if (ret) {
+		debugfs_remove_recursive(hd->debugfs_dentry);
 		device_del(&hd->dev);
 		return ret;
 	}
@@ -134,6 +222,8 @@ void gb_hd_del(struct gb_host_device *hd)
 
 	gb_connection_destroy(hd->svc_connection);
 
+	debugfs_remove_recursive(hd->debugfs_dentry);
+
 	device_del(&hd->dev);
 }
 EXPORT_SYMBOL_GPL(gb_hd_del);
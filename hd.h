@@ -13,6 +13,31 @@
 struct gb_host_device;
 struct gb_message;
 
+/* Maximum number of messages passed to message_send_batch at once */
+#define GB_HD_MESSAGE_BATCH_MAX		16
+
+/*
+ * Operation priority classes, highest first.  Host drivers should send
+ * messages of higher classes first when they run short of transmit
+ * resources.
+ */
+enum gb_operation_priority {
+	GB_OPERATION_PRIORITY_HIGH	= 0,	/* input events, control */
+	GB_OPERATION_PRIORITY_NORMAL	= 1,
+	GB_OPERATION_PRIORITY_LOW	= 2,	/* bulk data transfers */
+};
+#define GB_OPERATION_PRIORITY_COUNT	3
+
+/* Round-trip latency of the operations of a priority class */
+struct gb_hd_latency_stats {
+	atomic64_t	count;
+	atomic64_t	total_us;
+	atomic_t	max_us;
+};
+
+/* Number of slots in the operation timeout wheel (a power of two) */
+#define GB_HD_TIMEOUT_WHEEL_SIZE	128
+
 struct gb_hd_driver {
 	size_t	hd_priv_size;
 
@@ -20,7 +45,13 @@ struct gb_hd_driver {
 	int (*cport_disable)(struct gb_host_device *hd, u16 cport_id);
 	int (*message_send)(struct gb_host_device *hd, u16 dest_cport_id,
 			struct gb_message *message, gfp_t gfp_mask);
+	int (*message_send_batch)(struct gb_host_device *hd, u16 dest_cport_id,
+			struct gb_message **messages, unsigned int count,
+			gfp_t gfp_mask);
 	void (*message_cancel)(struct gb_message *message);
+	void (*message_cancel_batch)(struct gb_host_device *hd,
+			struct gb_message **messages, unsigned int count);
+	void (*rx_buffer_release)(struct gb_host_device *hd, void *cookie);
 	int (*latency_tag_enable)(struct gb_host_device *hd, u16 cport_id);
 	int (*latency_tag_disable)(struct gb_host_device *hd, u16 cport_id);
 };
@@ -40,9 +71,38 @@ struct gb_host_device {
 	/* Host device buffer constraints */
 	size_t buffer_size_max;
 
+	/*
+	 * Maximum number of scatterlist entries (including the one for the
+	 * message buffer) the host driver can send a message from, or zero
+	 * if messages with scatterlist payloads need to be flattened.
+	 */
+	unsigned int sg_tablesize;
+
 	struct gb_svc *svc;
 	struct gb_connection *svc_connection;
 
+	/* Workqueue to handle the host device's operation completions */
+	struct workqueue_struct *completion_wq;
+
+	/*
+	 * Timeout wheel for outgoing operations.  Operations are hashed
+	 * into a slot by deadline, and a single timer visits the slots
+	 * while any operation is pending.  Expired operations are
+	 * cancelled from timeout_work.
+	 */
+	spinlock_t timeout_lock;
+	struct timer_list timeout_timer;
+	unsigned long timeout_next;	/* next tick to visit */
+	unsigned int timeout_count;
+	struct list_head timeout_wheel[GB_HD_TIMEOUT_WHEEL_SIZE];
+	struct list_head timeout_expired;
+	struct work_struct timeout_work;
+
+	struct gb_hd_latency_stats latency[GB_OPERATION_PRIORITY_COUNT];
+	struct gb_hd_latency_stats teardown;	/* of a connection */
+
+	struct dentry *debugfs_dentry;
+
 	/* Private data for the host driver */
 	unsigned long hd_priv[0] __aligned(sizeof(s64));
 };
@@ -56,6 +116,8 @@ int gb_hd_add(struct gb_host_device *hd);
 void gb_hd_del(struct gb_host_device *hd);
 void gb_hd_put(struct gb_host_device *hd);
 
+void gb_hd_latency_add(struct gb_hd_latency_stats *stats, s64 us);
+
 int gb_hd_init(void);
 void gb_hd_exit(void);
 
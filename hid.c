@@ -435,6 +435,7 @@ static int gb_hid_connection_init(struct gb_connection *connection)
 	}
 
 	connection->private = ghid;
+	connection->priority = GB_OPERATION_PRIORITY_HIGH;
 	ghid->connection = connection;
 	ghid->hid = hid;
 
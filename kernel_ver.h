@@ -49,6 +49,14 @@
 	struct device_attribute dev_attr_##_name = __ATTR_RW(_name)
 #endif
 
+#ifndef READ_ONCE
+#define READ_ONCE(x)		ACCESS_ONCE(x)
+#endif
+
+#ifndef WRITE_ONCE
+#define WRITE_ONCE(x, val)	(ACCESS_ONCE(x) = (val))
+#endif
+
 #ifndef U8_MAX
 #define U8_MAX	((u8)~0U)
 #endif /* ! U8_MAX */
@@ -296,4 +304,48 @@ static inline bool led_sysfs_is_disabled(struct led_classdev *led_cdev)
 #define PSY_HAVE_PUT
 #endif
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 14, 0)
+/*
+ * Host controllers can tell whether they accept scatterlists with entries of
+ * any length for bulk transfers.
+ */
+#define USB_HAVE_NO_SG_CONSTRAINT
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 0)
+#define reinit_completion(x)	INIT_COMPLETION(*(x))
+
+#include <linux/llist.h>
+static inline struct llist_node *llist_reverse_order(struct llist_node *head)
+{
+	struct llist_node *new_head = NULL;
+
+	while (head) {
+		struct llist_node *tmp = head;
+
+		head = head->next;
+		tmp->next = new_head;
+		new_head = tmp;
+	}
+
+	return new_head;
+}
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 11, 0)
+#include <linux/kref.h>
+static inline unsigned int kref_read(const struct kref *kref)
+{
+	return atomic_read(&kref->refcount);
+}
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
+#include <linux/gfp.h>
+static inline bool gfpflags_allow_blocking(const gfp_t gfp_flags)
+{
+	return gfp_flags & __GFP_WAIT;
+}
+#endif
+
 #endif	/* __GREYBUS_KERNEL_VER_H */
@@ -45,6 +45,7 @@ struct gb_loopback_device {
 	wait_queue_head_t wq;
 
 	int type;
+	int async;
 	u32 mask;
 	u32 size;
 	u32 iteration_max;
@@ -52,6 +53,7 @@ struct gb_loopback_device {
 	size_t size_max;
 	int ms_wait;
 	u32 error;
+	u32 outstanding_operations_max;
 
 	struct timeval start;
 	struct timeval end;
@@ -75,6 +77,9 @@ struct gb_loopback {
 	struct mutex mutex;
 	struct task_struct *task;
 	struct list_head entry;
+	wait_queue_head_t wq_completion;
+	atomic_t outstanding_operations;
+	struct gb_operation *sync_operation;	/* reused between requests */
 
 	/* Per connection stats */
 	struct gb_loopback_stats latency;
@@ -101,6 +106,18 @@ module_param(kfifo_depth, uint, 0444);
 
 #define GB_LOOPBACK_MS_WAIT_MAX				1000
 
+/* Maximum number of operations a connection may have in flight */
+#define GB_LOOPBACK_OUTSTANDING_OPERATIONS_MAX		4096
+
+/* Number of operations preallocated per connection */
+#define GB_LOOPBACK_OP_POOL_SIZE			16
+
+/* Per-operation context for asynchronous transfers */
+struct gb_loopback_async_operation {
+	struct gb_loopback *gb;
+	struct timeval ts;
+};
+
 /* interface sysfs attributes */
 #define gb_loopback_ro_attr(field, pfx, conn)				\
 static ssize_t field##_##pfx##_show(struct device *dev,			\
@@ -236,6 +253,12 @@ static void gb_loopback_check_attr(struct gb_loopback_device *gb_dev,
 		gb_dev->ms_wait = GB_LOOPBACK_MS_WAIT_MAX;
 	if (gb_dev->size > gb_dev->size_max)
 		gb_dev->size = gb_dev->size_max;
+	if (gb_dev->outstanding_operations_max >
+			GB_LOOPBACK_OUTSTANDING_OPERATIONS_MAX)
+		gb_dev->outstanding_operations_max =
+			GB_LOOPBACK_OUTSTANDING_OPERATIONS_MAX;
+	if (!gb_dev->outstanding_operations_max)
+		gb_dev->outstanding_operations_max = 1;
 	gb_dev->iteration_count = 0;
 	gb_dev->error = 0;
 
@@ -305,6 +328,10 @@ gb_dev_loopback_rw_attr(iteration_max, u);
 gb_dev_loopback_ro_attr(iteration_count, false);
 /* A bit-mask of destination connecitons to include in the test run */
 gb_dev_loopback_rw_attr(mask, u);
+/* Send operations asynchronously: 0 => synchronous, 1 => asynchronous */
+gb_dev_loopback_rw_attr(async, d);
+/* Maximum operations in flight per connection in async mode: 1-4096 */
+gb_dev_loopback_rw_attr(outstanding_operations_max, u);
 
 static struct attribute *loopback_dev_attrs[] = {
 	&dev_attr_latency_min_dev.attr,
@@ -328,6 +355,8 @@ static struct attribute *loopback_dev_attrs[] = {
 	&dev_attr_iteration_count.attr,
 	&dev_attr_iteration_max.attr,
 	&dev_attr_mask.attr,
+	&dev_attr_async.attr,
+	&dev_attr_outstanding_operations_max.attr,
 	&dev_attr_error_dev.attr,
 	NULL,
 };
@@ -393,6 +422,34 @@ static int gb_loopback_active(struct gb_loopback *gb)
 	return (gb_dev.mask == 0 || (gb_dev.mask & gb->lbid));
 }
 
+/*
+ * Get an operation for a synchronous request.  The operation of the
+ * previous request is reused if it has the same type and sizes, so that
+ * back-to-back requests need no allocations.
+ */
+static struct gb_operation *
+gb_loopback_sync_operation_get(struct gb_loopback *gb, int type,
+				int request_size, int response_size)
+{
+	struct gb_operation *operation = gb->sync_operation;
+
+	if (operation) {
+		if (operation->type == type &&
+		    operation->request->payload_size == request_size &&
+		    operation->response->payload_size == response_size &&
+		    !gb_operation_reinit(operation))
+			return operation;
+
+		gb_operation_put(operation);
+	}
+
+	gb->sync_operation = gb_operation_create(gb->connection, type,
+						request_size, response_size,
+						GFP_KERNEL);
+
+	return gb->sync_operation;
+}
+
 static int gb_loopback_operation_sync(struct gb_loopback *gb, int type,
 				      void *request, int request_size,
 				      void *response, int response_size)
@@ -402,8 +459,8 @@ static int gb_loopback_operation_sync(struct gb_loopback *gb, int type,
 	int ret;
 
 	do_gettimeofday(&ts);
-	operation = gb_operation_create(gb->connection, type, request_size,
-					response_size, GFP_KERNEL);
+	operation = gb_loopback_sync_operation_get(gb, type, request_size,
+							response_size);
 	if (!operation) {
 		ret = -ENOMEM;
 		goto error;
@@ -428,8 +485,6 @@ static int gb_loopback_operation_sync(struct gb_loopback *gb, int type,
 		}
 	}
 
-	gb_operation_put(operation);
-
 error:
 	do_gettimeofday(&te);
 
@@ -440,6 +495,10 @@ error:
 	return ret;
 }
 
+static int gb_loopback_async_operation(struct gb_loopback *gb, int type,
+				       void *request, int request_size,
+				       int response_size);
+
 static int gb_loopback_sink(struct gb_loopback *gb, u32 len)
 {
 	struct gb_loopback_transfer_request *request;
@@ -450,9 +509,15 @@ static int gb_loopback_sink(struct gb_loopback *gb, u32 len)
 		return -ENOMEM;
 
 	request->len = cpu_to_le32(len);
-	retval = gb_loopback_operation_sync(gb, GB_LOOPBACK_TYPE_SINK,
-					    request, len + sizeof(*request),
-					    NULL, 0);
+	if (gb_dev.async)
+		retval = gb_loopback_async_operation(gb, GB_LOOPBACK_TYPE_SINK,
+						     request,
+						     len + sizeof(*request), 0);
+	else
+		retval = gb_loopback_operation_sync(gb, GB_LOOPBACK_TYPE_SINK,
+						    request,
+						    len + sizeof(*request),
+						    NULL, 0);
 	kfree(request);
 	return retval;
 }
@@ -466,15 +531,26 @@ static int gb_loopback_transfer(struct gb_loopback *gb, u32 len)
 	request = kmalloc(len + sizeof(*request), GFP_KERNEL);
 	if (!request)
 		return -ENOMEM;
+
+	memset(request->data, 0x5A, len);
+
+	request->len = cpu_to_le32(len);
+	if (gb_dev.async) {
+		/* The response is checked by the completion callback */
+		retval = gb_loopback_async_operation(gb,
+					GB_LOOPBACK_TYPE_TRANSFER,
+					request, len + sizeof(*request),
+					len + sizeof(*response));
+		kfree(request);
+		return retval;
+	}
+
 	response = kmalloc(len + sizeof(*response), GFP_KERNEL);
 	if (!response) {
 		kfree(request);
 		return -ENOMEM;
 	}
 
-	memset(request->data, 0x5A, len);
-
-	request->len = cpu_to_le32(len);
 	retval = gb_loopback_operation_sync(gb, GB_LOOPBACK_TYPE_TRANSFER,
 					    request, len + sizeof(*request),
 					    response, len + sizeof(*response));
@@ -498,6 +574,10 @@ gb_error:
 
 static int gb_loopback_ping(struct gb_loopback *gb)
 {
+	if (gb_dev.async)
+		return gb_loopback_async_operation(gb, GB_LOOPBACK_TYPE_PING,
+						   NULL, 0, 0);
+
 	return gb_loopback_operation_sync(gb, GB_LOOPBACK_TYPE_PING,
 					  NULL, 0, NULL, 0);
 }
@@ -718,10 +798,112 @@ static void gb_loopback_calculate_stats(struct gb_loopback *gb)
 				 gb->gpbridge_latency_ts);
 }
 
+static void gb_loopback_async_operation_callback(struct gb_operation *operation)
+{
+	struct gb_loopback_async_operation *op_async = operation->private;
+	struct gb_loopback *gb = op_async->gb;
+	struct gb_loopback_transfer_request *request;
+	struct gb_loopback_transfer_response *response;
+	struct timeval te;
+	int result;
+
+	do_gettimeofday(&te);
+	result = gb_operation_result(operation);
+
+	mutex_lock(&gb_dev.mutex);
+	mutex_lock(&gb->mutex);
+
+	gb->apbridge_latency_ts = 0;
+	gb->gpbridge_latency_ts = 0;
+	if (!result && operation->type == GB_LOOPBACK_TYPE_TRANSFER) {
+		request = operation->request->payload;
+		response = operation->response->payload;
+		if (memcmp(request->data, response->data,
+			   le32_to_cpu(request->len))) {
+			dev_err(&gb->connection->bundle->dev,
+				"Loopback Data doesn't match\n");
+			result = -EREMOTEIO;
+		}
+		gb->apbridge_latency_ts =
+			(u32)__le32_to_cpu(response->reserved0);
+		gb->gpbridge_latency_ts =
+			(u32)__le32_to_cpu(response->reserved1);
+	}
+
+	if (result) {
+		gb_dev.error++;
+		gb->error++;
+	}
+
+	/* Calculate the total time the message took */
+	gb_loopback_push_latency_ts(gb, &op_async->ts, &te);
+	gb->elapsed_nsecs = gb_loopback_calc_latency(&op_async->ts, &te);
+	gb_loopback_calculate_stats(gb);
+	gb->iteration_count++;
+
+	mutex_unlock(&gb->mutex);
+	mutex_unlock(&gb_dev.mutex);
+
+	kfree(op_async);
+	gb_operation_put(operation);
+
+	atomic_dec(&gb->outstanding_operations);
+	wake_up(&gb->wq_completion);
+}
+
+/*
+ * Send an operation without waiting for its response.  Statistics for
+ * the operation are recorded by the completion callback, which lets a
+ * single thread keep up to outstanding_operations_max requests in
+ * flight on the connection.
+ */
+static int gb_loopback_async_operation(struct gb_loopback *gb, int type,
+				       void *request, int request_size,
+				       int response_size)
+{
+	struct gb_loopback_async_operation *op_async;
+	struct gb_operation *operation;
+	int ret;
+
+	op_async = kzalloc(sizeof(*op_async), GFP_KERNEL);
+	if (!op_async)
+		return -ENOMEM;
+
+	operation = gb_operation_create(gb->connection, type, request_size,
+					response_size, GFP_KERNEL);
+	if (!operation) {
+		kfree(op_async);
+		return -ENOMEM;
+	}
+
+	if (request_size)
+		memcpy(operation->request->payload, request, request_size);
+
+	op_async->gb = gb;
+	operation->private = op_async;
+
+	atomic_inc(&gb->outstanding_operations);
+	do_gettimeofday(&op_async->ts);
+	ret = gb_operation_request_send(operation,
+					gb_loopback_async_operation_callback,
+					GB_OPERATION_TIMEOUT_DEFAULT,
+					GFP_KERNEL);
+	if (ret) {
+		dev_err(&gb->connection->bundle->dev,
+			"asynchronous operation failed: %d\n", ret);
+		atomic_dec(&gb->outstanding_operations);
+		gb_operation_put(operation);
+		kfree(op_async);
+	}
+
+	return ret;
+}
+
 static int gb_loopback_fn(void *data)
 {
 	int error = 0;
 	int ms_wait = 0;
+	int async;
 	int type;
 	u32 size;
 	u32 low_count;
@@ -765,10 +947,23 @@ static int gb_loopback_fn(void *data)
 		size = gb_dev.size;
 		ms_wait = gb_dev.ms_wait;
 		type = gb_dev.type;
+		async = gb_dev.async;
 		mutex_unlock(&gb_dev.mutex);
 
+		/* Wait for a free slot in the outstanding operation window */
+		if (async) {
+			wait_event_interruptible(gb->wq_completion,
+				atomic_read(&gb->outstanding_operations) <
+					gb_dev.outstanding_operations_max ||
+				kthread_should_stop());
+			if (kthread_should_stop())
+				break;
+		}
+
 		mutex_lock(&gb->mutex);
-		if (gb->iteration_count >= gb_dev.iteration_max) {
+		if (gb->iteration_count +
+				atomic_read(&gb->outstanding_operations) >=
+				gb_dev.iteration_max) {
 			/* If this thread finished before siblings then sleep */
 			ms_wait = 1;
 			mutex_unlock(&gb->mutex);
@@ -785,6 +980,10 @@ static int gb_loopback_fn(void *data)
 			error = gb_loopback_sink(gb, size);
 		mutex_unlock(&gb->mutex);
 
+		/* Successful async operations are accounted on completion */
+		if (async && !error)
+			goto sleep;
+
 		mutex_lock(&gb_dev.mutex);
 		mutex_lock(&gb->mutex);
 
@@ -792,7 +991,8 @@ static int gb_loopback_fn(void *data)
 			gb_dev.error++;
 			gb->error++;
 		}
-		gb_loopback_calculate_stats(gb);
+		if (!async)
+			gb_loopback_calculate_stats(gb);
 		gb->iteration_count++;
 
 		mutex_unlock(&gb->mutex);
@@ -950,6 +1150,7 @@ static int gb_loopback_connection_init(struct gb_connection *connection)
 	gb->file = debugfs_create_file(name, S_IFREG | S_IRUGO, gb_dev.root, gb,
 				       &gb_loopback_debugfs_latency_ops);
 	gb->connection = connection;
+	connection->priority = GB_OPERATION_PRIORITY_LOW;
 	connection->bundle->private = gb;
 	retval = sysfs_create_groups(&connection->bundle->dev.kobj,
 				     loopback_con_groups);
@@ -968,8 +1169,18 @@ static int gb_loopback_connection_init(struct gb_connection *connection)
 		goto out_kfifo0;
 	}
 
+	/* Preallocate operations for the test loop, freed by the core */
+	retval = gb_operation_pool_create(connection,
+				GB_LOOPBACK_OP_POOL_SIZE,
+				gb_operation_get_payload_size_max(connection),
+				gb_operation_get_payload_size_max(connection));
+	if (retval)
+		goto out_kfifo1;
+
 	/* Fork worker thread */
 	mutex_init(&gb->mutex);
+	init_waitqueue_head(&gb->wq_completion);
+	atomic_set(&gb->outstanding_operations, 0);
 	gb->task = kthread_run(gb_loopback_fn, gb, "gb_loopback");
 	if (IS_ERR(gb->task)) {
 		retval = PTR_ERR(gb->task);
@@ -1010,6 +1221,13 @@ static void gb_loopback_connection_exit(struct gb_connection *connection)
 	if (!IS_ERR_OR_NULL(gb->task))
 		kthread_stop(gb->task);
 
+	/* Outstanding operations have been cancelled, wait for callbacks */
+	wait_event(gb->wq_completion,
+		   !atomic_read(&gb->outstanding_operations));
+
+	if (gb->sync_operation)
+		gb_operation_put(gb->sync_operation);
+
 	mutex_lock(&gb_dev.mutex);
 
 	connection->bundle->private = NULL;
@@ -1037,6 +1255,7 @@ static struct gb_protocol loopback_protocol = {
 	.connection_init	= gb_loopback_connection_init,
 	.connection_exit	= gb_loopback_connection_exit,
 	.request_recv		= gb_loopback_request_recv,
+	.ordering		= GB_PROTOCOL_UNORDERED,
 };
 
 static int loopback_init(void)
@@ -1045,6 +1264,7 @@ static int loopback_init(void)
 
 	init_waitqueue_head(&gb_dev.wq);
 	INIT_LIST_HEAD(&gb_dev.list);
+	gb_dev.outstanding_operations_max = 1;
 	mutex_init(&gb_dev.mutex);
 	gb_dev.root = debugfs_create_dir("gb_loopback", NULL);
 
@@ -13,30 +13,45 @@
 #include <linux/sched.h>
 #include <linux/wait.h>
 #include <linux/workqueue.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/scatterlist.h>
 
 #include "greybus.h"
 #include "greybus_trace.h"
 
-static struct kmem_cache *gb_operation_cache;
-static struct kmem_cache *gb_message_cache;
+/*
+ * A pool of preallocated outgoing operations owned by a connection.
+ *
+ * Pooled operations keep their request and response messages (with
+ * buffers big enough for the largest payloads the pool was created
+ * for) across uses, so handing one out requires no allocation and no
+ * zeroing.  The pool is reference counted as operations handed out
+ * may outlive the connection's use of the pool.
+ */
+struct gb_operation_pool {
+	struct kref		kref;
+	spinlock_t		lock;
+	struct list_head	free;		/* operation->links */
+	bool			dead;
 
-/* Workqueue to handle Greybus operation completions. */
-static struct workqueue_struct *gb_operation_completion_wq;
+	unsigned int		count;
+	size_t			request_size;
+	size_t			response_size;
 
-/* Wait queue for synchronous cancellations. */
-static DECLARE_WAIT_QUEUE_HEAD(gb_operation_cancellation_queue);
+	u64			hits;
+	u64			misses;
 
-/*
- * Protects updates to operation->errno.
- */
-static DEFINE_SPINLOCK(gb_operations_lock);
+	struct dentry		*dentry;
+};
 
 static int gb_operation_response_send(struct gb_operation *operation,
 					int errno);
 
 /*
  * Increment operation active count and add to connection list unless the
- * connection is going away.
+ * connection is going away.  Outgoing operations are also hashed by id so
+ * that responses can be matched without walking the list.
  *
  * Caller holds operation reference.
  */
@@ -52,8 +67,13 @@ static int gb_operation_get_active(struct gb_operation *operation)
 		return -ENOTCONN;
 	}
 
-	if (operation->active++ == 0)
+	if (operation->active++ == 0) {
 		list_add_tail(&operation->links, &connection->operations);
+		if (!gb_operation_is_incoming(operation)) {
+			hash_add(connection->outgoing_operations,
+					&operation->hash_links, operation->id);
+		}
+	}
 
 	spin_unlock_irqrestore(&connection->lock, flags);
 
@@ -69,8 +89,11 @@ static void gb_operation_put_active(struct gb_operation *operation)
 	spin_lock_irqsave(&connection->lock, flags);
 	if (--operation->active == 0) {
 		list_del(&operation->links);
-		if (atomic_read(&operation->waiters))
-			wake_up(&gb_operation_cancellation_queue);
+		if (!gb_operation_is_incoming(operation))
+			hash_del(&operation->hash_links);
+		if (atomic_read(&operation->waiters) ||
+				list_empty(&connection->operations))
+			wake_up(&connection->cancel_wq);
 	}
 	spin_unlock_irqrestore(&connection->lock, flags);
 }
@@ -102,7 +125,8 @@ static bool gb_operation_is_active(struct gb_operation *operation)
  * sent, that result "sticks."  That is, if two concurrent threads
  * race to set the result, the first one wins.  The return value
  * tells the caller whether its result was recorded; if not the
- * caller has nothing more to do.
+ * caller has nothing more to do.  The transitions are made with
+ * cmpxchg() so that racing threads need not share a lock.
  *
  * The result value -EILSEQ is reserved to signal an implementation
  * error; if it's ever observed, the code performing the request has
@@ -115,7 +139,6 @@ static bool gb_operation_is_active(struct gb_operation *operation)
  */
 static bool gb_operation_result_set(struct gb_operation *operation, int result)
 {
-	unsigned long flags;
 	int prev;
 
 	if (result == -EINPROGRESS) {
@@ -126,14 +149,9 @@ static bool gb_operation_result_set(struct gb_operation *operation, int result)
 		 * and record an implementation error if it's
 		 * set at any other time.
 		 */
-		spin_lock_irqsave(&gb_operations_lock, flags);
-		prev = operation->errno;
-		if (prev == -EBADR)
-			operation->errno = result;
-		else
-			operation->errno = -EILSEQ;
-		spin_unlock_irqrestore(&gb_operations_lock, flags);
-		WARN_ON(prev != -EBADR);
+		prev = cmpxchg(&operation->errno, -EBADR, result);
+		if (WARN_ON(prev != -EBADR))
+			xchg(&operation->errno, -EILSEQ);
 
 		return true;
 	}
@@ -150,18 +168,25 @@ static bool gb_operation_result_set(struct gb_operation *operation, int result)
 	if (WARN_ON(result == -EBADR))
 		result = -EILSEQ; /* Nobody should be setting -EBADR */
 
-	spin_lock_irqsave(&gb_operations_lock, flags);
-	prev = operation->errno;
-	if (prev == -EINPROGRESS)
-		operation->errno = result;	/* First and final result */
-	spin_unlock_irqrestore(&gb_operations_lock, flags);
+	/* Only the first and final result makes it out of -EINPROGRESS */
+	prev = cmpxchg(&operation->errno, -EINPROGRESS, result);
 
 	return prev == -EINPROGRESS;
 }
 
+/*
+ * Put the result of an outgoing operation back in its initial state, so
+ * that the request can be sent (again).  Nothing may be setting the result
+ * concurrently, but it goes through the same atomic accessors.
+ */
+static void gb_operation_result_reset(struct gb_operation *operation)
+{
+	xchg(&operation->errno, -EBADR);
+}
+
 int gb_operation_result(struct gb_operation *operation)
 {
-	int result = operation->errno;
+	int result = READ_ONCE(operation->errno);
 
 	WARN_ON(result == -EBADR);
 	WARN_ON(result == -EINPROGRESS);
@@ -182,13 +207,14 @@ gb_operation_find_outgoing(struct gb_connection *connection, u16 operation_id)
 	bool found = false;
 
 	spin_lock_irqsave(&connection->lock, flags);
-	list_for_each_entry(operation, &connection->operations, links)
-		if (operation->id == operation_id &&
-				!gb_operation_is_incoming(operation)) {
+	hash_for_each_possible(connection->outgoing_operations, operation,
+				hash_links, operation_id) {
+		if (operation->id == operation_id) {
 			gb_operation_get(operation);
 			found = true;
 			break;
 		}
+	}
 	spin_unlock_irqrestore(&connection->lock, flags);
 
 	return found ? operation : NULL;
@@ -223,7 +249,7 @@ static void gb_operation_request_handle(struct gb_operation *operation)
 	int ret;
 
 	if (!protocol)
-		return;
+		goto out_complete;
 
 	if (protocol->request_recv) {
 		status = protocol->request_recv(operation->type, operation);
@@ -240,15 +266,19 @@ static void gb_operation_request_handle(struct gb_operation *operation)
 		dev_err(&connection->hd->dev,
 			"%s: failed to send response %d for type 0x%02hhx: %d\n",
 			connection->name, status, operation->type, ret);
-			return;
 	}
+
+out_complete:
+	/* Let gb_operation_cancel_incoming() know the handler is done */
+	complete_all(&operation->completion);
 }
 
 /*
  * Process operation work.
  *
- * For incoming requests, call the protocol request handler. The operation
- * result should be -EINPROGRESS at this point.
+ * For incoming requests of protocols that don't need them ordered, call
+ * the protocol request handler. The operation result should be
+ * -EINPROGRESS at this point.
  *
  * For outgoing requests, the operation result value should have
  * been set before queueing this.  The operation callback function
@@ -270,296 +300,1138 @@ static void gb_operation_work(struct work_struct *work)
 	gb_operation_put(operation);
 }
 
-static void gb_operation_message_init(struct gb_host_device *hd,
-				struct gb_message *message, u16 operation_id,
-				size_t payload_size, u8 type)
+/*
+ * Return the lane of the connection an incoming request is to be handled
+ * on, as required by the protocol, or NULL if it may be handled on its own.
+ */
+static struct gb_connection_incoming *
+gb_operation_incoming_lane(struct gb_operation *operation)
 {
-	struct gb_operation_msg_hdr *header;
-
-	header = message->buffer;
-
-	message->header = header;
-	message->payload = payload_size ? header + 1 : NULL;
-	message->payload_size = payload_size;
+	struct gb_connection *connection = operation->connection;
+	struct gb_protocol *protocol = connection->protocol;
+	unsigned int lane;
 
-	/*
-	 * The type supplied for incoming message buffers will be
-	 * 0x00.  Such buffers will be overwritten by arriving data
-	 * so there's no need to initialize the message header.
-	 */
-	if (type != GB_OPERATION_TYPE_INVALID) {
-		u16 message_size = (u16)(sizeof(*header) + payload_size);
+	if (!protocol)
+		return &connection->incoming[0];
 
-		/*
-		 * For a request, the operation id gets filled in
-		 * when the message is sent.  For a response, it
-		 * will be copied from the request by the caller.
-		 *
-		 * The result field in a request message must be
-		 * zero.  It will be set just prior to sending for
-		 * a response.
-		 */
-		header->size = cpu_to_le16(message_size);
-		header->operation_id = 0;
-		header->type = type;
-		header->result = 0;
+	switch (protocol->ordering) {
+	case GB_PROTOCOL_UNORDERED:
+		return NULL;
+	case GB_PROTOCOL_ORDERED_PER_TYPE:
+		lane = operation->type % GB_CONNECTION_INCOMING_LANES;
+		return &connection->incoming[lane];
+	case GB_PROTOCOL_ORDERED:
+	default:
+		return &connection->incoming[0];
 	}
 }
 
 /*
- * Allocate a message to be used for an operation request or response.
- * Both types of message contain a common header.  The request message
- * for an outgoing operation is outbound, as is the response message
- * for an incoming operation.  The message header for an outbound
- * message is partially initialized here.
- *
- * The headers for inbound messages don't need to be initialized;
- * they'll be filled in by arriving data.
+ * Handle the incoming requests of a lane in order of arrival, calling the
+ * protocol request handler of up to incoming_budget of them (or all of
+ * them if zero) before yielding the workqueue.  The operation results
+ * should be -EINPROGRESS at this point.
  *
- * Our message buffers have the following layout:
- *	message header  \_ these combined are
- *	message payload /  the message size
+ * A work item never runs concurrently with itself, so the lane's pending
+ * list needs no locking.
  */
-static struct gb_message *
-gb_operation_message_alloc(struct gb_host_device *hd, u8 type,
-				size_t payload_size, gfp_t gfp_flags)
+void gb_operation_incoming_work(struct work_struct *work)
 {
-	struct gb_message *message;
-	struct gb_operation_msg_hdr *header;
-	size_t message_size = payload_size + sizeof(*header);
-
-	if (message_size > hd->buffer_size_max) {
-		pr_warn("requested message size too big (%zu > %zu)\n",
-				message_size, hd->buffer_size_max);
-		return NULL;
-	}
-
-	/* Allocate the message structure and buffer. */
-	message = kmem_cache_zalloc(gb_message_cache, gfp_flags);
-	if (!message)
-		return NULL;
+	struct gb_connection_incoming *incoming;
+	struct gb_connection *connection;
+	struct gb_operation *operation;
+	struct llist_node *node;
+	unsigned int budget;
+	unsigned int count = 0;
 
-	message->buffer = kzalloc(message_size, gfp_flags);
-	if (!message->buffer)
-		goto err_free_message;
+	incoming = container_of(work, struct gb_connection_incoming, work);
+	connection = incoming->connection;
+	budget = READ_ONCE(connection->incoming_budget);
 
-	/* Initialize the message.  Operation id is filled in later. */
-	gb_operation_message_init(hd, message, 0, payload_size, type);
+	node = incoming->pending;
+	if (!node)
+		node = llist_reverse_order(llist_del_all(&incoming->list));
 
-	return message;
+	while (node && (!budget || count < budget)) {
+		operation = llist_entry(node, struct gb_operation,
+					incoming_node);
+		node = node->next;
 
-err_free_message:
-	kmem_cache_free(gb_message_cache, message);
+		gb_operation_request_handle(operation);
+		gb_operation_put_active(operation);
+		gb_operation_put(operation);
+		count++;
+	}
 
-	return NULL;
-}
+	incoming->pending = node;
 
-static void gb_operation_message_free(struct gb_message *message)
-{
-	kfree(message->buffer);
-	kmem_cache_free(gb_message_cache, message);
+	if (node || !llist_empty(&incoming->list))
+		queue_work(connection->wq, &incoming->work);
 }
+EXPORT_SYMBOL_GPL(gb_operation_incoming_work);
 
 /*
- * Map an enum gb_operation_status value (which is represented in a
- * message as a single byte) to an appropriate Linux negative errno.
+ * Operation timeouts are tracked in a hashed timer wheel per host device.
+ * Time is divided into ticks of 2^gb_operation_timeout_shift jiffies, and
+ * an operation is kept in the slot of the first tick starting at or after
+ * its deadline (modulo the size of the wheel).  A single timer visits the
+ * slots a tick at a time while operations are pending, expiring those whose
+ * deadline has passed and leaving the rest for a later round.
  */
-static int gb_operation_status_map(u8 status)
+#define GB_OPERATION_TIMEOUT_RESOLUTION	10	/* milliseconds */
+
+static unsigned int gb_operation_timeout_shift;
+
+static struct list_head *
+gb_operation_timeout_slot(struct gb_host_device *hd, unsigned long time)
 {
-	switch (status) {
-	case GB_OP_SUCCESS:
-		return 0;
-	case GB_OP_INTERRUPTED:
-		return -EINTR;
-	case GB_OP_TIMEOUT:
-		return -ETIMEDOUT;
-	case GB_OP_NO_MEMORY:
-		return -ENOMEM;
-	case GB_OP_PROTOCOL_BAD:
-		return -EPROTONOSUPPORT;
-	case GB_OP_OVERFLOW:
-		return -EMSGSIZE;
-	case GB_OP_INVALID:
-		return -EINVAL;
-	case GB_OP_RETRY:
-		return -EAGAIN;
-	case GB_OP_NONEXISTENT:
-		return -ENODEV;
-	case GB_OP_MALFUNCTION:
-		return -EILSEQ;
-	case GB_OP_UNKNOWN_ERROR:
-	default:
-		return -EIO;
-	}
+	unsigned long tick = 1UL << gb_operation_timeout_shift;
+	unsigned long i;
+
+	i = ((time + tick - 1) >> gb_operation_timeout_shift) &
+		(GB_HD_TIMEOUT_WHEEL_SIZE - 1);
+
+	return &hd->timeout_wheel[i];
 }
 
 /*
- * Map a Linux errno value (from operation->errno) into the value
- * that should represent it in a response message status sent
- * over the wire.  Returns an enum gb_operation_status value (which
- * is represented in a message as a single byte).
+ * Start the timeout of an operation which has been sent, unless it has
+ * completed already.  The caller must hold a reference to the operation
+ * of its own, as the one taken for the completion may be gone by now.
  */
-static u8 gb_operation_errno_map(int errno)
+static void gb_operation_timeout_add(struct gb_operation *operation,
+					unsigned int timeout)
 {
-	switch (errno) {
-	case 0:
-		return GB_OP_SUCCESS;
-	case -EINTR:
-		return GB_OP_INTERRUPTED;
-	case -ETIMEDOUT:
-		return GB_OP_TIMEOUT;
-	case -ENOMEM:
-		return GB_OP_NO_MEMORY;
-	case -EPROTONOSUPPORT:
-		return GB_OP_PROTOCOL_BAD;
-	case -EMSGSIZE:
-		return GB_OP_OVERFLOW;	/* Could be underflow too */
-	case -EINVAL:
-		return GB_OP_INVALID;
-	case -EAGAIN:
-		return GB_OP_RETRY;
-	case -EILSEQ:
-		return GB_OP_MALFUNCTION;
-	case -ENODEV:
-		return GB_OP_NONEXISTENT;
-	case -EIO:
-	default:
-		return GB_OP_UNKNOWN_ERROR;
+	struct gb_host_device *hd = operation->connection->hd;
+	unsigned long tick = 1UL << gb_operation_timeout_shift;
+	unsigned long flags;
+
+	if (timeout == GB_OPERATION_TIMEOUT_ADAPTIVE) {
+		timeout = gb_connection_rtt_timeout(operation->connection,
+							operation->type);
+	}
+
+	spin_lock_irqsave(&hd->timeout_lock, flags);
+	if (READ_ONCE(operation->errno) != -EINPROGRESS)
+		goto out_unlock;
+
+	operation->deadline = jiffies + msecs_to_jiffies(timeout);
+	list_add_tail(&operation->timeout_links,
+			gb_operation_timeout_slot(hd, operation->deadline));
+
+	if (hd->timeout_count++ == 0) {
+		hd->timeout_next = (jiffies & ~(tick - 1)) + tick;
+		mod_timer(&hd->timeout_timer, hd->timeout_next);
 	}
+out_unlock:
+	spin_unlock_irqrestore(&hd->timeout_lock, flags);
 }
 
-bool gb_operation_response_alloc(struct gb_operation *operation,
-					size_t response_size, gfp_t gfp)
+static void gb_operation_timeout_del(struct gb_operation *operation)
 {
 	struct gb_host_device *hd = operation->connection->hd;
-	struct gb_operation_msg_hdr *request_header;
-	struct gb_message *response;
-	u8 type;
-
-	type = operation->type | GB_MESSAGE_TYPE_RESPONSE;
-	response = gb_operation_message_alloc(hd, type, response_size, gfp);
-	if (!response)
-		return false;
-	response->operation = operation;
-
-	/*
-	 * Size and type get initialized when the message is
-	 * allocated.  The errno will be set before sending.  All
-	 * that's left is the operation id, which we copy from the
-	 * request message header (as-is, in little-endian order).
-	 */
-	request_header = operation->request->header;
-	response->header->operation_id = request_header->operation_id;
-	operation->response = response;
+	unsigned long flags;
 
-	return true;
+	spin_lock_irqsave(&hd->timeout_lock, flags);
+	if (!list_empty(&operation->timeout_links)) {
+		list_del_init(&operation->timeout_links);
+		hd->timeout_count--;
+	}
+	spin_unlock_irqrestore(&hd->timeout_lock, flags);
 }
-EXPORT_SYMBOL_GPL(gb_operation_response_alloc);
 
-/*
- * Create a Greybus operation to be sent over the given connection.
- * The request buffer will be big enough for a payload of the given
- * size.
- *
- * For outgoing requests, the request message's header will be
- * initialized with the type of the request and the message size.
- * Outgoing operations must also specify the response buffer size,
- * which must be sufficient to hold all expected response data.  The
- * response message header will eventually be overwritten, so there's
- * no need to initialize it here.
- *
- * Request messages for incoming operations can arrive in interrupt
- * context, so they must be allocated with GFP_ATOMIC.  In this case
- * the request buffer will be immediately overwritten, so there is
- * no need to initialize the message header.  Responsibility for
- * allocating a response buffer lies with the incoming request
- * handler for a protocol.  So we don't allocate that here.
- *
- * Returns a pointer to the new operation or a null pointer if an
- * error occurs.
- */
-static struct gb_operation *
-gb_operation_create_common(struct gb_connection *connection, u8 type,
-				size_t request_size, size_t response_size,
-				unsigned long op_flags, gfp_t gfp_flags)
+static void gb_operation_timeout_timer(unsigned long data)
 {
-	struct gb_host_device *hd = connection->hd;
+	struct gb_host_device *hd = (struct gb_host_device *)data;
+	unsigned long tick = 1UL << gb_operation_timeout_shift;
 	struct gb_operation *operation;
+	struct gb_operation *next;
+	struct list_head *slot;
+	unsigned long now = jiffies;
+	unsigned long flags;
+	bool expired = false;
+	int i;
 
-	operation = kmem_cache_zalloc(gb_operation_cache, gfp_flags);
-	if (!operation)
-		return NULL;
-	operation->connection = connection;
-
-	operation->request = gb_operation_message_alloc(hd, type, request_size,
-							gfp_flags);
-	if (!operation->request)
-		goto err_cache;
-	operation->request->operation = operation;
+	spin_lock_irqsave(&hd->timeout_lock, flags);
+	for (i = 0; i < GB_HD_TIMEOUT_WHEEL_SIZE; i++) {
+		if (time_before(now, hd->timeout_next))
+			break;
 
-	/* Allocate the response buffer for outgoing operations */
-	if (!(op_flags & GB_OPERATION_FLAG_INCOMING)) {
-		if (!gb_operation_response_alloc(operation, response_size,
-						 gfp_flags)) {
-			goto err_request;
+		slot = gb_operation_timeout_slot(hd, hd->timeout_next);
+		list_for_each_entry_safe(operation, next, slot,
+						timeout_links) {
+			if (time_before(now, operation->deadline))
+				continue;
+
+			/*
+			 * Operations that completed in the mean time are
+			 * just dropped, the others get cancelled from
+			 * process context.
+			 */
+			if (gb_operation_result_set(operation, -ETIMEDOUT)) {
+				list_move_tail(&operation->timeout_links,
+						&hd->timeout_expired);
+				expired = true;
+			} else {
+				list_del_init(&operation->timeout_links);
+				hd->timeout_count--;
+			}
 		}
+		hd->timeout_next += tick;
 	}
 
-	operation->flags = op_flags;
-	operation->type = type;
-	operation->errno = -EBADR;  /* Initial value--means "never set" */
+	/* Every slot has been visited if we fell behind by a whole round */
+	if (!time_before(now, hd->timeout_next))
+		hd->timeout_next = (now & ~(tick - 1)) + tick;
 
-	INIT_WORK(&operation->work, gb_operation_work);
-	init_completion(&operation->completion);
-	kref_init(&operation->kref);
-	atomic_set(&operation->waiters, 0);
+	if (hd->timeout_count)
+		mod_timer(&hd->timeout_timer, hd->timeout_next);
+	spin_unlock_irqrestore(&hd->timeout_lock, flags);
 
-	return operation;
+	if (expired)
+		queue_work(hd->completion_wq, &hd->timeout_work);
+}
 
-err_request:
-	gb_operation_message_free(operation->request);
-err_cache:
-	kmem_cache_free(gb_operation_cache, operation);
+static void gb_operation_complete_outgoing(struct gb_operation *operation);
 
-	return NULL;
+/* Cancel the operations whose result has been set to -ETIMEDOUT */
+static void gb_operation_timeout_work(struct work_struct *work)
+{
+	struct gb_host_device *hd;
+	struct gb_operation *operation;
+	unsigned long flags;
+
+	hd = container_of(work, struct gb_host_device, timeout_work);
+
+	spin_lock_irqsave(&hd->timeout_lock, flags);
+	while (!list_empty(&hd->timeout_expired)) {
+		operation = list_first_entry(&hd->timeout_expired,
+						struct gb_operation,
+						timeout_links);
+		list_del_init(&operation->timeout_links);
+		hd->timeout_count--;
+		spin_unlock_irqrestore(&hd->timeout_lock, flags);
+
+		gb_message_cancel(operation->request);
+		gb_operation_complete_outgoing(operation);
+
+		spin_lock_irqsave(&hd->timeout_lock, flags);
+	}
+	spin_unlock_irqrestore(&hd->timeout_lock, flags);
 }
 
-/*
- * Create a new operation associated with the given connection.  The
- * request and response sizes provided are the number of bytes
- * required to hold the request/response payload only.  Both of
- * these are allowed to be 0.  Note that 0x00 is reserved as an
- * invalid operation type for all protocols, and this is enforced
- * here.
- */
-struct gb_operation *gb_operation_create(struct gb_connection *connection,
-					u8 type, size_t request_size,
-					size_t response_size,
-					gfp_t gfp)
+void gb_operation_timeouts_init(struct gb_host_device *hd)
 {
-	if (WARN_ON_ONCE(type == GB_OPERATION_TYPE_INVALID))
-		return NULL;
-	if (WARN_ON_ONCE(type & GB_MESSAGE_TYPE_RESPONSE))
-		type &= ~GB_MESSAGE_TYPE_RESPONSE;
+	int i;
+
+	spin_lock_init(&hd->timeout_lock);
+	setup_timer(&hd->timeout_timer, gb_operation_timeout_timer,
+			(unsigned long)hd);
+	for (i = 0; i < GB_HD_TIMEOUT_WHEEL_SIZE; i++)
+		INIT_LIST_HEAD(&hd->timeout_wheel[i]);
+	INIT_LIST_HEAD(&hd->timeout_expired);
+	INIT_WORK(&hd->timeout_work, gb_operation_timeout_work);
+}
 
-	return gb_operation_create_common(connection, type,
-					request_size, response_size, 0, gfp);
+void gb_operation_timeouts_exit(struct gb_host_device *hd)
+{
+	del_timer_sync(&hd->timeout_timer);
+	cancel_work_sync(&hd->timeout_work);
 }
-EXPORT_SYMBOL_GPL(gb_operation_create);
 
-size_t gb_operation_get_payload_size_max(struct gb_connection *connection)
+/*
+ * Take a credit from the connection's window of in-flight requests for an
+ * outgoing operation, if one is available.
+ *
+ * Caller holds the connection lock.
+ */
+static bool __gb_operation_window_get(struct gb_operation *operation)
 {
-	struct gb_host_device *hd = connection->hd;
+	struct gb_connection *connection = operation->connection;
+	unsigned int window = READ_ONCE(connection->window);
 
-	return hd->buffer_size_max - sizeof(struct gb_operation_msg_hdr);
+	if (window && connection->window_used >= window)
+		return false;
+
+	if (++connection->window_used > connection->window_used_max)
+		connection->window_used_max = connection->window_used;
+	operation->window_credit = true;
+
+	return true;
 }
-EXPORT_SYMBOL_GPL(gb_operation_get_payload_size_max);
 
+static bool gb_operation_window_try_get(struct gb_operation *operation)
+{
+	struct gb_connection *connection = operation->connection;
+	unsigned long flags;
+	bool ret;
+
+	spin_lock_irqsave(&connection->lock, flags);
+	ret = __gb_operation_window_get(operation);
+	spin_unlock_irqrestore(&connection->lock, flags);
+
+	return ret;
+}
+
+/* Stop waiting for a credit once we get one, or have been cancelled */
+static bool gb_operation_window_wait_done(struct gb_operation *operation)
+{
+	if (READ_ONCE(operation->errno) != -EINPROGRESS)
+		return true;
+
+	return gb_operation_window_try_get(operation);
+}
+
+/*
+ * Take a window credit for an active outgoing operation before sending
+ * it.  If the window is full, the connection's window policy decides
+ * whether to wait for a credit, to fail, or to queue the operation for
+ * gb_operation_window_work() to send later.
+ *
+ * Returns 0 if the operation got a credit and should be sent, 1 if there
+ * is nothing more to do (it was queued, or cancelled while waiting), or
+ * -EAGAIN.
+ */
+static int gb_operation_window_get(struct gb_operation *operation, gfp_t gfp)
+{
+	struct gb_connection *connection = operation->connection;
+	unsigned long flags;
+
+	spin_lock_irqsave(&connection->lock, flags);
+	if (__gb_operation_window_get(operation)) {
+		spin_unlock_irqrestore(&connection->lock, flags);
+		return 0;
+	}
+
+	connection->window_stalls++;
+
+	switch (connection->window_policy) {
+	case GB_CONNECTION_WINDOW_QUEUE:
+		list_add_tail(&operation->window_links,
+				&connection->window_queue[operation->priority]);
+		connection->window_queued++;
+		spin_unlock_irqrestore(&connection->lock, flags);
+		return 1;
+	case GB_CONNECTION_WINDOW_BLOCK:
+		if (gfpflags_allow_blocking(gfp))
+			break;
+		/* fall through */
+	default:
+		spin_unlock_irqrestore(&connection->lock, flags);
+		return -EAGAIN;
+	}
+	spin_unlock_irqrestore(&connection->lock, flags);
+
+	wait_event(connection->window_wq,
+			gb_operation_window_wait_done(operation));
+
+	return operation->window_credit ? 0 : 1;
+}
+
+/*
+ * Give back an outgoing operation's window credit, or take it off the
+ * window queue, when it completes or could not be sent.
+ */
+static void gb_operation_window_put(struct gb_operation *operation)
+{
+	struct gb_connection *connection = operation->connection;
+	unsigned long flags;
+	bool dispatch = false;
+
+	spin_lock_irqsave(&connection->lock, flags);
+	if (!list_empty(&operation->window_links)) {
+		list_del_init(&operation->window_links);
+		connection->window_queued--;
+	} else if (operation->window_credit) {
+		operation->window_credit = false;
+		connection->window_used--;
+		dispatch = connection->window_queued;
+	}
+	spin_unlock_irqrestore(&connection->lock, flags);
+
+	if (dispatch) {
+		queue_work(connection->hd->completion_wq,
+				&connection->window_work);
+	}
+
+	if (waitqueue_active(&connection->window_wq))
+		wake_up(&connection->window_wq);
+}
+
+/* Return the first queued operation of the highest priority class */
+static struct gb_operation *
+gb_operation_window_next(struct gb_connection *connection)
+{
+	int i;
+
+	for (i = 0; i < GB_OPERATION_PRIORITY_COUNT; i++) {
+		if (!list_empty(&connection->window_queue[i])) {
+			return list_first_entry(&connection->window_queue[i],
+						struct gb_operation,
+						window_links);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Send queued operations, highest priority class first, as long as the
+ * connection's window allows.
+ */
+void gb_operation_window_work(struct work_struct *work)
+{
+	struct gb_connection *connection;
+	struct gb_operation *operation;
+	unsigned long flags;
+	int ret;
+
+	connection = container_of(work, struct gb_connection, window_work);
+
+	spin_lock_irqsave(&connection->lock, flags);
+	while ((operation = gb_operation_window_next(connection))) {
+		/* Leave operations that are being completed alone */
+		if (READ_ONCE(operation->errno) != -EINPROGRESS) {
+			list_del_init(&operation->window_links);
+			connection->window_queued--;
+			continue;
+		}
+
+		if (!__gb_operation_window_get(operation))
+			break;
+
+		list_del_init(&operation->window_links);
+		connection->window_queued--;
+		gb_operation_get(operation);
+		spin_unlock_irqrestore(&connection->lock, flags);
+
+		ret = gb_message_send(operation->request, GFP_KERNEL);
+		if (ret && gb_operation_result_set(operation, ret))
+			gb_operation_complete_outgoing(operation);
+		gb_operation_put(operation);
+
+		spin_lock_irqsave(&connection->lock, flags);
+	}
+	spin_unlock_irqrestore(&connection->lock, flags);
+}
+
+/*
+ * Fold a round-trip time sample into an estimate as TCP does (RFC 6298),
+ * with a gain of 1/8 for the smoothed mean and of 1/4 for the mean
+ * deviation.  Concurrent updates may lose a sample, which is harmless.
+ */
+static void gb_operation_rtt_sample(struct gb_connection_rtt *rtt, s64 us)
+{
+	u32 sample = clamp_val(us, 1, U32_MAX);
+	u32 srtt, rttvar, delta;
+
+	srtt = READ_ONCE(rtt->srtt_us);
+	rttvar = READ_ONCE(rtt->rttvar_us);
+
+	if (!srtt) {
+		srtt = sample;
+		rttvar = sample / 2;
+	} else {
+		delta = srtt > sample ? srtt - sample : sample - srtt;
+		rttvar = rttvar - (rttvar >> 2) + (delta >> 2);
+		srtt = srtt - (srtt >> 3) + (sample >> 3);
+	}
+
+	WRITE_ONCE(rtt->srtt_us, srtt);
+	WRITE_ONCE(rtt->rttvar_us, rttvar);
+	WRITE_ONCE(rtt->samples, rtt->samples + 1);
+}
+
+/* Fold a round-trip time sample into the estimates for an operation type */
+static void gb_operation_rtt_update(struct gb_operation *operation, s64 us)
+{
+	struct gb_connection *connection = operation->connection;
+
+	gb_operation_rtt_sample(
+		&connection->rtt[operation->type % GB_CONNECTION_RTT_TYPES], us);
+}
+
+/*
+ * Account the round-trip time of an operation to its priority class and to
+ * the estimates of its type.
+ */
+static void gb_operation_latency_update(struct gb_operation *operation)
+{
+	struct gb_host_device *hd = operation->connection->hd;
+	s64 us = ktime_us_delta(ktime_get(), operation->send_time);
+
+	gb_hd_latency_add(&hd->latency[operation->priority], us);
+	gb_operation_rtt_update(operation, us);
+}
+
+/*
+ * Complete an outgoing operation once its result has been set.
+ *
+ * Callbacks that may be called in atomic context are called directly,
+ * saving a trip through the completion workqueue; all others are called
+ * from gb_operation_work().
+ */
+static void gb_operation_complete_outgoing(struct gb_operation *operation)
+{
+	struct gb_connection *connection = operation->connection;
+	int cpu;
+
+	gb_operation_timeout_del(operation);
+	gb_operation_window_put(operation);
+
+	if (!operation->errno)
+		gb_operation_latency_update(operation);
+
+	if (!gb_operation_has_atomic_callback(operation)) {
+		/*
+		 * Completions are handled by the host device's workqueue,
+		 * on the current CPU unless the connection asks for a
+		 * specific (online) one.
+		 */
+		cpu = READ_ONCE(connection->completion_cpu);
+		if (cpu < 0 || !cpu_online(cpu))
+			cpu = WORK_CPU_UNBOUND;
+
+		queue_work_on(cpu, connection->hd->completion_wq,
+				&operation->work);
+		return;
+	}
+
+	operation->callback(operation);
+
+	gb_operation_put_active(operation);
+	gb_operation_put(operation);
+}
+
+static void gb_operation_message_init(struct gb_host_device *hd,
+				struct gb_message *message, u16 operation_id,
+				size_t payload_size, u8 type)
+{
+	struct gb_operation_msg_hdr *header;
+
+	header = message->buffer;
+
+	message->header = header;
+	message->payload = payload_size ? header + 1 : NULL;
+	message->payload_size = payload_size;
+	message->sg = NULL;
+	message->sg_nents = 0;
+	message->sg_skip = 0;
+	message->sg_size = 0;
+
+	/*
+	 * The type supplied for incoming message buffers will be
+	 * 0x00.  Such buffers will be overwritten by arriving data
+	 * so there's no need to initialize the message header.
+	 */
+	if (type != GB_OPERATION_TYPE_INVALID) {
+		u16 message_size = (u16)(sizeof(*header) + payload_size);
+
+		/*
+		 * For a request, the operation id gets filled in
+		 * when the message is sent.  For a response, it
+		 * will be copied from the request by the caller.
+		 *
+		 * The result field in a request message must be
+		 * zero.  It will be set just prior to sending for
+		 * a response.
+		 */
+		header->size = cpu_to_le16(message_size);
+		header->operation_id = 0;
+		header->type = type;
+		header->result = 0;
+	}
+}
+
+/*
+ * Operations are allocated from one of a few caches, depending on the
+ * size of the payloads they carry.  The objects of all but the first
+ * cache have room for a request and response message buffer following
+ * the operation structure, so that small operations (which make up most
+ * of the traffic) need just a single allocation:
+ *
+ *	struct gb_operation	(including both struct gb_message)
+ *	request header		\_ request buffer
+ *	request payload		/
+ *	(padding)
+ *	response header		\_ response buffer
+ *	response payload	/
+ *
+ * Operations with larger payloads come from the first cache and have
+ * their message buffers allocated separately.
+ *
+ * Inline message buffers share cache lines with the operation structure
+ * so they must only be used for outbound DMA by host-device drivers.
+ */
+#define GB_OPERATION_BUFFER_SIZE(payload_size) \
+	((payload_size) + 2 * sizeof(struct gb_operation_msg_hdr))
+
+static struct {
+	const char		*name;
+	size_t			buffer_size;
+	struct kmem_cache	*cache;
+} gb_operation_caches[] = {
+	{ "gb_operation_cache",		0 },
+	{ "gb_operation_cache_64",	GB_OPERATION_BUFFER_SIZE(64) },
+	{ "gb_operation_cache_256",	GB_OPERATION_BUFFER_SIZE(256) },
+	{ "gb_operation_cache_1024",	GB_OPERATION_BUFFER_SIZE(1024) },
+	{ "gb_operation_cache_2048",	GB_OPERATION_BUFFER_SIZE(2048) },
+};
+
+/* Offset of the response buffer within an operation's inline buffers */
+static size_t gb_operation_response_offset(size_t request_size)
+{
+	return ALIGN(sizeof(struct gb_operation_msg_hdr) + request_size,
+			sizeof(u64));
+}
+
+/*
+ * Allocate an operation from the smallest cache whose objects have room
+ * for request and response messages with the given payload sizes.
+ *
+ * For incoming operations the response size is not known until the
+ * request has been handled, and 0 is passed.  A larger response may
+ * still fit in the space left over, or will be allocated separately.
+ */
+static struct gb_operation *
+gb_operation_alloc(size_t request_size, size_t response_size, gfp_t gfp)
+{
+	struct gb_operation *operation;
+	size_t buffer_size;
+	int i;
+
+	buffer_size = gb_operation_response_offset(request_size) +
+			sizeof(struct gb_operation_msg_hdr) + response_size;
+
+	for (i = 1; i < ARRAY_SIZE(gb_operation_caches); i++) {
+		if (buffer_size <= gb_operation_caches[i].buffer_size)
+			break;
+	}
+	if (i == ARRAY_SIZE(gb_operation_caches))
+		i = 0;
+
+	operation = kmem_cache_alloc(gb_operation_caches[i].cache, gfp);
+	if (!operation)
+		return NULL;
+
+	/* Message buffers are cleared as they are handed out */
+	memset(operation, 0, sizeof(*operation));
+	operation->cache = gb_operation_caches[i].cache;
+	operation->buffer_size = gb_operation_caches[i].buffer_size;
+
+	return operation;
+}
+
+static bool gb_operation_buffer_is_inline(struct gb_operation *operation,
+						void *buffer)
+{
+	u8 *p = buffer;
+
+	return p >= operation->buffers &&
+		p < operation->buffers + operation->buffer_size;
+}
+
+/*
+ * Allocate a message buffer to be used for an operation request or
+ * response.  Both types of message contain a common header.  The
+ * request message for an outgoing operation is outbound, as is the
+ * response message for an incoming operation.  The message header for
+ * an outbound message is partially initialized here.
+ *
+ * The headers for inbound messages don't need to be initialized;
+ * they'll be filled in by arriving data.
+ *
+ * The buffer is placed at the given offset in the operation's inline
+ * buffer space if it fits, and is allocated separately otherwise.
+ */
+static bool gb_operation_message_alloc(struct gb_operation *operation,
+					struct gb_message *message,
+					size_t offset, u8 type,
+					size_t payload_size, gfp_t gfp_flags)
+{
+	struct gb_host_device *hd = operation->connection->hd;
+	size_t message_size = payload_size + sizeof(*message->header);
+
+	if (message_size > hd->buffer_size_max) {
+		pr_warn("requested message size too big (%zu > %zu)\n",
+				message_size, hd->buffer_size_max);
+		return false;
+	}
+
+	if (offset + message_size <= operation->buffer_size) {
+		message->buffer = operation->buffers + offset;
+		memset(message->buffer, 0, message_size);
+	} else {
+		message->buffer = kzalloc(message_size, gfp_flags);
+		if (!message->buffer)
+			return false;
+	}
+	message->operation = operation;
+
+	/* Initialize the message.  Operation id is filled in later. */
+	gb_operation_message_init(hd, message, 0, payload_size, type);
+
+	return true;
+}
+
+static void gb_operation_message_free(struct gb_message *message)
+{
+	struct gb_operation *operation = message->operation;
+	struct gb_host_device *hd;
+
+	/* Hand buffers lent to us back to the host driver */
+	if (message == operation->request &&
+			gb_operation_has_rx_buffer(operation)) {
+		hd = operation->connection->hd;
+		hd->driver->rx_buffer_release(hd, message->hcpriv);
+		return;
+	}
+
+	if (!gb_operation_buffer_is_inline(operation, message->buffer))
+		kfree(message->buffer);
+}
+
+/*
+ * Map an enum gb_operation_status value (which is represented in a
+ * message as a single byte) to an appropriate Linux negative errno.
+ */
+static int gb_operation_status_map(u8 status)
+{
+	switch (status) {
+	case GB_OP_SUCCESS:
+		return 0;
+	case GB_OP_INTERRUPTED:
+		return -EINTR;
+	case GB_OP_TIMEOUT:
+		return -ETIMEDOUT;
+	case GB_OP_NO_MEMORY:
+		return -ENOMEM;
+	case GB_OP_PROTOCOL_BAD:
+		return -EPROTONOSUPPORT;
+	case GB_OP_OVERFLOW:
+		return -EMSGSIZE;
+	case GB_OP_INVALID:
+		return -EINVAL;
+	case GB_OP_RETRY:
+		return -EAGAIN;
+	case GB_OP_NONEXISTENT:
+		return -ENODEV;
+	case GB_OP_MALFUNCTION:
+		return -EILSEQ;
+	case GB_OP_UNKNOWN_ERROR:
+	default:
+		return -EIO;
+	}
+}
+
+/*
+ * Map a Linux errno value (from operation->errno) into the value
+ * that should represent it in a response message status sent
+ * over the wire.  Returns an enum gb_operation_status value (which
+ * is represented in a message as a single byte).
+ */
+static u8 gb_operation_errno_map(int errno)
+{
+	switch (errno) {
+	case 0:
+		return GB_OP_SUCCESS;
+	case -EINTR:
+		return GB_OP_INTERRUPTED;
+	case -ETIMEDOUT:
+		return GB_OP_TIMEOUT;
+	case -ENOMEM:
+		return GB_OP_NO_MEMORY;
+	case -EPROTONOSUPPORT:
+		return GB_OP_PROTOCOL_BAD;
+	case -EMSGSIZE:
+		return GB_OP_OVERFLOW;	/* Could be underflow too */
+	case -EINVAL:
+		return GB_OP_INVALID;
+	case -EAGAIN:
+		return GB_OP_RETRY;
+	case -EILSEQ:
+		return GB_OP_MALFUNCTION;
+	case -ENODEV:
+		return GB_OP_NONEXISTENT;
+	case -EIO:
+	default:
+		return GB_OP_UNKNOWN_ERROR;
+	}
+}
+
+bool gb_operation_response_alloc(struct gb_operation *operation,
+					size_t response_size, gfp_t gfp)
+{
+	struct gb_operation_msg_hdr *request_header;
+	struct gb_message *response = &operation->response_message;
+	size_t offset;
+	u8 type;
+
+	type = operation->type | GB_MESSAGE_TYPE_RESPONSE;
+	if (gb_operation_has_rx_buffer(operation))
+		offset = 0;
+	else
+		offset = gb_operation_response_offset(
+					operation->request->payload_size);
+	if (!gb_operation_message_alloc(operation, response, offset, type,
+					response_size, gfp))
+		return false;
+
+	/*
+	 * Size and type get initialized when the message is
+	 * allocated.  The errno will be set before sending.  All
+	 * that's left is the operation id, which we copy from the
+	 * request message header (as-is, in little-endian order).
+	 */
+	request_header = operation->request->header;
+	response->header->operation_id = request_header->operation_id;
+	operation->response = response;
+
+	return true;
+}
+EXPORT_SYMBOL_GPL(gb_operation_response_alloc);
+
+/* Take a free operation from the connection's pool, if its buffers fit */
+static struct gb_operation *
+gb_operation_pool_get(struct gb_connection *connection, size_t request_size,
+				size_t response_size)
+{
+	struct gb_operation_pool *pool = connection->op_pool;
+	struct gb_operation *operation = NULL;
+	unsigned long flags;
+
+	if (!pool)
+		return NULL;
+
+	spin_lock_irqsave(&pool->lock, flags);
+	if (request_size > pool->request_size ||
+			response_size > pool->response_size ||
+			list_empty(&pool->free)) {
+		pool->misses++;
+	} else {
+		operation = list_first_entry(&pool->free, struct gb_operation,
+						links);
+		list_del(&operation->links);
+		kref_get(&pool->kref);
+		pool->hits++;
+	}
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	return operation;
+}
+
+/*
+ * Prepare an operation taken from a connection's pool for reuse.  Only
+ * the fields that a previous use may have changed are reinitialized;
+ * the message buffers are not cleared.
+ */
+static void gb_operation_pool_prepare(struct gb_operation *operation,
+					u8 type, size_t request_size,
+					size_t response_size)
+{
+	struct gb_host_device *hd = operation->connection->hd;
+
+	gb_operation_message_init(hd, operation->request, 0, request_size,
+					type);
+	operation->request->hcpriv = NULL;
+	gb_operation_message_init(hd, operation->response, 0, response_size,
+					type | GB_MESSAGE_TYPE_RESPONSE);
+	operation->response->hcpriv = NULL;
+
+	operation->id = 0;
+	operation->callback = NULL;
+	operation->active = 0;
+	operation->private = NULL;
+}
+
+/* Initialize the state of a new operation, whatever its storage */
+static void gb_operation_init_common(struct gb_operation *operation, u8 type,
+				unsigned long op_flags)
+{
+	operation->flags = op_flags;
+	operation->type = type;
+	operation->errno = -EBADR;  /* Initial value--means "never set" */
+	operation->priority = READ_ONCE(operation->connection->priority);
+
+	INIT_WORK(&operation->work, gb_operation_work);
+	INIT_LIST_HEAD(&operation->timeout_links);
+	INIT_LIST_HEAD(&operation->window_links);
+	operation->window_credit = false;
+	init_completion(&operation->completion);
+	kref_init(&operation->kref);
+	atomic_set(&operation->waiters, 0);
+}
+
+/*
+ * Create a Greybus operation to be sent over the given connection.
+ * The request buffer will be big enough for a payload of the given
+ * size.
+ *
+ * For outgoing requests, the request message's header will be
+ * initialized with the type of the request and the message size.
+ * Outgoing operations must also specify the response buffer size,
+ * which must be sufficient to hold all expected response data.  The
+ * response message header will eventually be overwritten, so there's
+ * no need to initialize it here.
+ *
+ * Request messages for incoming operations can arrive in interrupt
+ * context, so they must be allocated with GFP_ATOMIC.  In this case
+ * the request buffer will be immediately overwritten, so there is
+ * no need to initialize the message header.  Responsibility for
+ * allocating a response buffer lies with the incoming request
+ * handler for a protocol.  So we don't allocate that here.
+ *
+ * Returns a pointer to the new operation or a null pointer if an
+ * error occurs.
+ */
+static struct gb_operation *
+gb_operation_create_common(struct gb_connection *connection, u8 type,
+				size_t request_size, size_t response_size,
+				unsigned long op_flags, gfp_t gfp_flags)
+{
+	struct gb_operation *operation;
+
+	if (!(op_flags & GB_OPERATION_FLAG_INCOMING)) {
+		operation = gb_operation_pool_get(connection, request_size,
+							response_size);
+		if (operation) {
+			gb_operation_pool_prepare(operation, type,
+						request_size, response_size);
+			goto init;
+		}
+	}
+
+	/* Host-driver request buffers leave the inline space to responses */
+	if (op_flags & GB_OPERATION_FLAG_RX_BUFFER)
+		operation = gb_operation_alloc(0, 0, gfp_flags);
+	else
+		operation = gb_operation_alloc(request_size, response_size,
+						gfp_flags);
+	if (!operation)
+		return NULL;
+	operation->connection = connection;
+
+	/*
+	 * The type and flags need to be known before the response message
+	 * gets allocated.
+	 */
+	operation->type = type;
+	operation->flags = op_flags;
+
+	if (op_flags & GB_OPERATION_FLAG_RX_BUFFER) {
+		/* The caller sets up the buffer */
+		operation->request_message.operation = operation;
+	} else if (!gb_operation_message_alloc(operation,
+					&operation->request_message, 0, type,
+					request_size, gfp_flags)) {
+		goto err_cache;
+	}
+	operation->request = &operation->request_message;
+
+	/* Allocate the response buffer for outgoing operations */
+	if (!(op_flags & GB_OPERATION_FLAG_INCOMING)) {
+		if (!gb_operation_response_alloc(operation, response_size,
+						 gfp_flags)) {
+			goto err_request;
+		}
+	}
+
+init:
+	gb_operation_init_common(operation, type, op_flags);
+
+	return operation;
+
+err_request:
+	gb_operation_message_free(operation->request);
+err_cache:
+	kmem_cache_free(operation->cache, operation);
+
+	return NULL;
+}
+
+/*
+ * Create a new operation associated with the given connection.  The
+ * request and response sizes provided are the number of bytes
+ * required to hold the request/response payload only.  Both of
+ * these are allowed to be 0.  Note that 0x00 is reserved as an
+ * invalid operation type for all protocols, and this is enforced
+ * here.
+ *
+ * Only the flags in GB_OPERATION_FLAG_USER_MASK may be passed.
+ */
+struct gb_operation *
+gb_operation_create_flags(struct gb_connection *connection,
+				u8 type, size_t request_size,
+				size_t response_size, unsigned long flags,
+				gfp_t gfp)
+{
+	if (WARN_ON_ONCE(type == GB_OPERATION_TYPE_INVALID))
+		return NULL;
+	if (WARN_ON_ONCE(type & GB_MESSAGE_TYPE_RESPONSE))
+		type &= ~GB_MESSAGE_TYPE_RESPONSE;
+
+	if (WARN_ON_ONCE(flags & ~GB_OPERATION_FLAG_USER_MASK))
+		flags &= GB_OPERATION_FLAG_USER_MASK;
+
+	return gb_operation_create_common(connection, type,
+					request_size, response_size, flags,
+					gfp);
+}
+EXPORT_SYMBOL_GPL(gb_operation_create_flags);
+
+/*
+ * Find the entries of a scatterlist holding size bytes of data starting skip
+ * bytes into it.  On return *sg points to the first of them, *nents is
+ * their number and *skip the offset of the data into the first one.
+ *
+ * Returns false if the list is too short.
+ */
+static bool gb_operation_sg_find(struct scatterlist **sg, unsigned int *nents,
+					size_t *skip, size_t size)
+{
+	struct scatterlist *first = *sg;
+	unsigned int left = *nents;
+	size_t offset = *skip;
+	struct scatterlist *s;
+	unsigned int count;
+	size_t len;
+
+	while (first && left && offset >= first->length) {
+		offset -= first->length;
+		first = sg_next(first);
+		left--;
+	}
+
+	len = 0;
+	count = 0;
+	for (s = first; len < offset + size; s = sg_next(s)) {
+		if (!s || count == left)
+			return false;
+		len += s->length;
+		count++;
+	}
+
+	*sg = first;
+	*nents = count;
+	*skip = offset;
+
+	return true;
+}
+
+/**
+ * gb_operation_create_sg() - create an operation with a scatterlist payload
+ * @connection:		connection to create the operation for
+ * @type:		operation type
+ * @request_size:	size of the request payload preceding any sg data
+ * @response_size:	size of the response payload preceding any sg data
+ * @sg:			scatterlist holding the data
+ * @sg_nents:		number of entries in @sg
+ * @sg_skip:		offset of the data into @sg
+ * @sg_size:		number of bytes of data
+ * @dir:		DMA_TO_DEVICE if the data follows the request payload,
+ *			DMA_FROM_DEVICE if it follows the response payload
+ * @gfp:		memory allocation flags
+ *
+ * Create an outgoing operation whose request or response payload ends
+ * with sg_size bytes kept in a scatterlist, rather than copying them
+ * in or out of the message buffer.  Received response data is copied
+ * directly into the list, and request data is sent from it by host
+ * devices that support it.  For other host devices the request data is
+ * copied into the message buffer here, so it must be in place when the
+ * operation is created and remain so until it has completed.
+ *
+ * Return: The new operation, or NULL on errors.
+ */
+struct gb_operation *
+gb_operation_create_sg(struct gb_connection *connection,
+				u8 type, size_t request_size,
+				size_t response_size, struct scatterlist *sg,
+				unsigned int sg_nents, size_t sg_skip,
+				size_t sg_size, enum dma_data_direction dir,
+				gfp_t gfp)
+{
+	struct gb_host_device *hd = connection->hd;
+	struct gb_operation *operation;
+	struct gb_message *message;
+	size_t payload_size;
+	bool flatten = false;
+
+	if (WARN_ON_ONCE(dir != DMA_TO_DEVICE && dir != DMA_FROM_DEVICE))
+		return NULL;
+
+	if (!gb_operation_sg_find(&sg, &sg_nents, &sg_skip, sg_size)) {
+		pr_warn("scatterlist too short for %zu bytes\n", sg_size);
+		return NULL;
+	}
+
+	if (dir == DMA_TO_DEVICE) {
+		payload_size = request_size;
+		flatten = sg_nents + 1 > hd->sg_tablesize;
+	} else {
+		payload_size = response_size;
+	}
+
+	if (sizeof(struct gb_operation_msg_hdr) + payload_size + sg_size >
+			hd->buffer_size_max) {
+		pr_warn("requested message size too big (%zu > %zu)\n",
+			sizeof(struct gb_operation_msg_hdr) + payload_size +
+			sg_size, hd->buffer_size_max);
+		return NULL;
+	}
+
+	if (flatten) {
+		operation = gb_operation_create(connection, type,
+						request_size + sg_size,
+						response_size, gfp);
+		if (!operation)
+			return NULL;
+
+		sg_pcopy_to_buffer(sg, sg_nents,
+				operation->request->payload + request_size,
+				sg_size, sg_skip);
+
+		return operation;
+	}
+
+	operation = gb_operation_create(connection, type, request_size,
+					response_size, gfp);
+	if (!operation)
+		return NULL;
+
+	if (dir == DMA_TO_DEVICE)
+		message = operation->request;
+	else
+		message = operation->response;
+
+	message->sg = sg;
+	message->sg_nents = sg_nents;
+	message->sg_skip = sg_skip;
+	message->sg_size = sg_size;
+	message->header->size = cpu_to_le16(gb_message_size(message));
+
+	return operation;
+}
+EXPORT_SYMBOL_GPL(gb_operation_create_sg);
+
+size_t gb_operation_get_payload_size_max(struct gb_connection *connection)
+{
+	struct gb_host_device *hd = connection->hd;
+
+	return hd->buffer_size_max - sizeof(struct gb_operation_msg_hdr);
+}
+EXPORT_SYMBOL_GPL(gb_operation_get_payload_size_max);
+
+/*
+ * Create an incoming operation for the given request data.  If cookie is
+ * non-null, the data is in a buffer lent by the host driver which is used
+ * as the request buffer as-is rather than copied.
+ */
 static struct gb_operation *
 gb_operation_create_incoming(struct gb_connection *connection, u16 id,
-				u8 type, void *data, size_t size)
+				u8 type, void *data, size_t size, void *cookie)
 {
 	struct gb_operation *operation;
+	struct gb_message *request;
 	size_t request_size;
 	unsigned long flags = GB_OPERATION_FLAG_INCOMING;
 
@@ -568,6 +1440,8 @@ gb_operation_create_incoming(struct gb_connection *connection, u16 id,
 
 	if (!id)
 		flags |= GB_OPERATION_FLAG_UNIDIRECTIONAL;
+	if (cookie)
+		flags |= GB_OPERATION_FLAG_RX_BUFFER;
 
 	operation = gb_operation_create_common(connection, type,
 					request_size, 0, flags, GFP_ATOMIC);
@@ -575,7 +1449,17 @@ gb_operation_create_incoming(struct gb_connection *connection, u16 id,
 		return NULL;
 
 	operation->id = id;
-	memcpy(operation->request->header, data, size);
+
+	if (cookie) {
+		request = operation->request;
+		request->buffer = data;
+		request->hcpriv = cookie;
+		gb_operation_message_init(connection->hd, request, 0,
+						request_size,
+						GB_OPERATION_TYPE_INVALID);
+	} else {
+		memcpy(operation->request->header, data, size);
+	}
 
 	return operation;
 }
@@ -589,6 +1473,45 @@ void gb_operation_get(struct gb_operation *operation)
 }
 EXPORT_SYMBOL_GPL(gb_operation_get);
 
+static void gb_operation_free(struct gb_operation *operation)
+{
+	if (operation->response)
+		gb_operation_message_free(operation->response);
+	gb_operation_message_free(operation->request);
+
+	kmem_cache_free(operation->cache, operation);
+}
+
+static void gb_operation_pool_release(struct kref *kref)
+{
+	struct gb_operation_pool *pool;
+
+	pool = container_of(kref, struct gb_operation_pool, kref);
+	kfree(pool);
+}
+
+/*
+ * Return a pooled operation to its pool, or free it if the pool has
+ * been destroyed in the mean time.
+ */
+static void gb_operation_pool_put(struct gb_operation *operation)
+{
+	struct gb_operation_pool *pool = operation->pool;
+	unsigned long flags;
+
+	spin_lock_irqsave(&pool->lock, flags);
+	if (!pool->dead) {
+		list_add(&operation->links, &pool->free);
+		operation = NULL;
+	}
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	if (operation)
+		gb_operation_free(operation);
+
+	kref_put(&pool->kref, gb_operation_pool_release);
+}
+
 /*
  * Destroy a previously created operation.
  */
@@ -598,11 +1521,13 @@ static void _gb_operation_destroy(struct kref *kref)
 
 	operation = container_of(kref, struct gb_operation, kref);
 
-	if (operation->response)
-		gb_operation_message_free(operation->response);
-	gb_operation_message_free(operation->request);
+	if (WARN_ON(gb_operation_is_embedded(operation)))
+		return;
 
-	kmem_cache_free(gb_operation_cache, operation);
+	if (operation->pool)
+		gb_operation_pool_put(operation);
+	else
+		gb_operation_free(operation);
 }
 
 /*
@@ -611,19 +1536,137 @@ static void _gb_operation_destroy(struct kref *kref)
  */
 void gb_operation_put(struct gb_operation *operation)
 {
+	struct gb_connection *connection;
+
 	if (WARN_ON(!operation))
 		return;
 
+	/*
+	 * The owner of an embedded operation keeps the last reference, and
+	 * waits for the core to drop the others before reusing the storage,
+	 * so don't touch the operation once our reference is gone.
+	 */
+	if (gb_operation_is_embedded(operation)) {
+		connection = operation->connection;
+		kref_put(&operation->kref, _gb_operation_destroy);
+		wake_up(&connection->cancel_wq);
+		return;
+	}
+
 	kref_put(&operation->kref, _gb_operation_destroy);
 }
 EXPORT_SYMBOL_GPL(gb_operation_put);
 
+/**
+ * gb_operation_reinit() - prepare an outgoing operation to be sent again
+ * @operation:	the operation to reinitialize
+ *
+ * Reset an outgoing operation whose request has been sent before, so that
+ * it can be sent again without allocating a new one.  The messages and
+ * their buffers are kept, as is the request payload for the caller to
+ * update, and a new id and result are assigned when the request is sent.
+ * The priority class goes back to that of the connection, and no window
+ * credit or timeout is carried over.
+ *
+ * The operation must have completed.  This waits for the core to be done
+ * with it, so it can not be called in atomic context.
+ *
+ * Return: 0 on success, or -EINVAL for an incoming operation.
+ */
+int gb_operation_reinit(struct gb_operation *operation)
+{
+	struct gb_message *response = operation->response;
+	struct gb_operation_msg_hdr *header;
+
+	might_sleep();
+
+	if (WARN_ON(gb_operation_is_incoming(operation)))
+		return -EINVAL;
+
+	/* The completion callback may run before the operation goes idle */
+	atomic_inc(&operation->waiters);
+	wait_event(operation->connection->cancel_wq,
+			!gb_operation_is_active(operation));
+	atomic_dec(&operation->waiters);
+
+	operation->request->header->operation_id = 0;
+	operation->request->hcpriv = NULL;
+
+	/* The response header has been overwritten by the one received */
+	if (response) {
+		header = response->header;
+		header->size = cpu_to_le16(gb_message_size(response));
+		header->operation_id = 0;
+		header->type = operation->type | GB_MESSAGE_TYPE_RESPONSE;
+		header->result = 0;
+		response->hcpriv = NULL;
+	}
+
+	operation->id = 0;
+	gb_operation_result_reset(operation);
+	operation->callback = NULL;
+	operation->priority = READ_ONCE(operation->connection->priority);
+	operation->deadline = 0;
+	operation->window_credit = false;
+	reinit_completion(&operation->completion);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(gb_operation_reinit);
+
 /* Tell the requester we're done */
 static void gb_operation_sync_callback(struct gb_operation *operation)
 {
 	complete(&operation->completion);
 }
 
+/*
+ * Get an operation ready to be sent: record its callback, assign it the id
+ * derived from the given cycle, mark it in flight and take the reference
+ * dropped on completion.
+ */
+static void gb_operation_request_prepare(struct gb_operation *operation,
+					gb_operation_callback callback,
+					unsigned int cycle)
+{
+	struct gb_operation_msg_hdr *header;
+
+	/*
+	 * Record the callback function, which is executed in
+	 * non-atomic (workqueue) context when the final result
+	 * of an operation has been set, unless the operation was
+	 * flagged as having an atomic callback.
+	 */
+	operation->callback = callback;
+	operation->send_time = ktime_get();
+
+	/*
+	 * Assign the operation's id, and store it in the request header.
+	 * Zero is a reserved operation id.
+	 */
+	operation->id = (u16)(cycle % U16_MAX + 1);
+	header = operation->request->header;
+	header->operation_id = cpu_to_le16(operation->id);
+
+	gb_operation_result_set(operation, -EINPROGRESS);
+
+	/*
+	 * Get an extra reference on the operation. It'll be dropped when the
+	 * operation completes.
+	 */
+	gb_operation_get(operation);
+}
+
+/*
+ * Undo gb_operation_request_prepare() for an operation that was not sent,
+ * so that it can be sent again.
+ */
+static void gb_operation_request_unprepare(struct gb_operation *operation)
+{
+	gb_operation_result_reset(operation);
+	gb_operation_put(operation);
+}
+
 /*
  * Send an operation request message. The caller has filled in any payload so
  * the request message is ready to go. The callback function supplied will be
@@ -631,92 +1674,327 @@ static void gb_operation_sync_callback(struct gb_operation *operation)
  * complete. In that case, the callback function is responsible for fetching
  * the result of the operation using gb_operation_result() if desired, and
  * dropping the initial reference to the operation.
+ *
+ * If a non-zero timeout (in milliseconds) is given, an operation whose
+ * response has not arrived by then is cancelled with -ETIMEDOUT.
+ */
+int gb_operation_request_send(struct gb_operation *operation,
+				gb_operation_callback callback,
+				unsigned int timeout, gfp_t gfp)
+{
+	struct gb_connection *connection = operation->connection;
+	unsigned int cycle;
+	int ret;
+
+	if (!callback)
+		return -EINVAL;
+
+	cycle = (unsigned int)atomic_inc_return(&connection->op_cycle);
+	gb_operation_request_prepare(operation, callback, cycle);
+
+	ret = gb_operation_get_active(operation);
+	if (ret)
+		goto err_put;
+
+	/*
+	 * The operation may complete, and the callback drop the last
+	 * reference to it, as soon as it has been sent.  Hold another one
+	 * until its timeout has been started.
+	 */
+	gb_operation_get(operation);
+
+	ret = gb_operation_window_get(operation, gfp);
+	if (ret < 0)
+		goto err_put_timeout;
+
+	if (!ret) {
+		ret = gb_message_send(operation->request, gfp);
+		if (ret)
+			goto err_window_put;
+	}
+
+	if (timeout)
+		gb_operation_timeout_add(operation, timeout);
+	gb_operation_put(operation);
+
+	return 0;
+
+err_window_put:
+	gb_operation_window_put(operation);
+err_put_timeout:
+	gb_operation_put(operation);
+	gb_operation_put_active(operation);
+err_put:
+	gb_operation_request_unprepare(operation);
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(gb_operation_request_send);
+
+/*
+ * Send up to GB_HD_MESSAGE_BATCH_MAX requests using the host driver's
+ * message_send_batch callback, as far as the connection's window allows.
+ * Sets @window_full if the window stopped us from sending them all.
+ * Returns the number of operations sent, which is zero if the window is
+ * full, or a negative errno if none were.
+ */
+static int gb_operation_request_send_chunk(struct gb_operation **operations,
+					unsigned int count,
+					gb_operation_callback callback,
+					unsigned int timeout, gfp_t gfp,
+					bool *window_full)
+{
+	struct gb_connection *connection = operations[0]->connection;
+	struct gb_host_device *hd = connection->hd;
+	struct gb_message *messages[GB_HD_MESSAGE_BATCH_MAX];
+	struct gb_operation *operation;
+	unsigned int cycle;
+	unsigned int i;
+	int sent;
+	int ret = 0;
+
+	/* Reserve a range of ids for the whole chunk */
+	cycle = (unsigned int)atomic_add_return(count, &connection->op_cycle);
+	cycle -= count;
+
+	*window_full = false;
+	for (i = 0; i < count; i++) {
+		operation = operations[i];
+		if (!gb_operation_window_try_get(operation)) {
+			*window_full = true;
+			break;
+		}
+
+		gb_operation_request_prepare(operation, callback, ++cycle);
+
+		ret = gb_operation_get_active(operation);
+		if (ret) {
+			gb_operation_window_put(operation);
+			gb_operation_request_unprepare(operation);
+			break;
+		}
+
+		/* Held until the timeout has been started, see above */
+		gb_operation_get(operation);
+
+		trace_gb_message_send(operation->request);
+		messages[i] = operation->request;
+	}
+
+	if (!i)
+		return ret;
+
+	sent = hd->driver->message_send_batch(hd, connection->hd_cport_id,
+						messages, i, gfp);
+	if (sent < 0) {
+		ret = sent;
+		sent = 0;
+	}
+
+	/* Undo the preparation of the requests that were not sent */
+	while (i > sent) {
+		operation = operations[--i];
+		gb_operation_window_put(operation);
+		gb_operation_put_active(operation);
+		gb_operation_put(operation);
+		gb_operation_request_unprepare(operation);
+	}
+
+	for (i = 0; i < sent; i++) {
+		operation = operations[i];
+		if (timeout)
+			gb_operation_timeout_add(operation, timeout);
+		gb_operation_put(operation);
+	}
+
+	return sent ? sent : ret;
+}
+
+/**
+ * gb_operation_request_send_batch() - send a batch of operation requests
+ * @operations:	array of operations to send
+ * @count:	number of operations in @operations
+ * @callback:	callback to call for every operation on completion
+ * @timeout:	timeout of every operation in milliseconds, 0 for none, or
+ *		GB_OPERATION_TIMEOUT_ADAPTIVE
+ * @gfp:	memory allocation flags
+ *
+ * Send a number of operations over the same connection, as with
+ * gb_operation_request_send(), but with the ids assigned in one pass and
+ * the requests handed to the host driver together if it supports it.
+ * Operations are sent in array order.  When the connection's window is
+ * full, the remaining operations are subject to its window policy just
+ * like with gb_operation_request_send().
+ *
+ * Return: The number of operations sent, which is less than @count if an
+ * error occurred, or a negative errno if none could be sent.  Operations
+ * that were not sent remain the caller's to dispose of or to send again.
+ */
+int gb_operation_request_send_batch(struct gb_operation **operations,
+					unsigned int count,
+					gb_operation_callback callback,
+					unsigned int timeout, gfp_t gfp)
+{
+	struct gb_connection *connection;
+	unsigned int sent = 0;
+	bool window_full;
+	unsigned int n;
+	unsigned int i;
+	int ret = 0;
+
+	if (!count)
+		return 0;
+	if (!callback)
+		return -EINVAL;
+
+	connection = operations[0]->connection;
+	for (i = 1; i < count; i++) {
+		if (WARN_ON(operations[i]->connection != connection))
+			return -EINVAL;
+	}
+
+	/* Fall back to sending one message at a time */
+	if (!connection->hd->driver->message_send_batch) {
+		for (sent = 0; sent < count; sent++) {
+			ret = gb_operation_request_send(operations[sent],
+							callback, timeout, gfp);
+			if (ret)
+				break;
+		}
+
+		return sent ? sent : ret;
+	}
+
+	while (sent < count) {
+		n = min_t(unsigned int, count - sent, GB_HD_MESSAGE_BATCH_MAX);
+		ret = gb_operation_request_send_chunk(&operations[sent], n,
+							callback, timeout, gfp,
+							&window_full);
+		if (ret < 0)
+			break;
+
+		if (!ret) {
+			/* The window is full, so leave it to its policy */
+			ret = gb_operation_request_send(operations[sent],
+							callback, timeout, gfp);
+			if (ret)
+				break;
+			ret = 1;
+		} else if (ret < n && !window_full) {
+			/* The host driver could not take them all */
+			sent += ret;
+			ret = 0;
+			break;
+		}
+
+		sent += ret;
+	}
+
+	return sent ? sent : ret;
+}
+EXPORT_SYMBOL_GPL(gb_operation_request_send_batch);
+
+/*
+ * Return the number of microseconds a synchronous operation on the given
+ * connection should busy-wait for its response before going to sleep.
+ *
+ * Spinning is disabled unless the connection has a spin limit set.  The
+ * window is twice the smoothed round-trip time of previous synchronous
+ * operations, capped at the limit, and we don't spin at all if responses
+ * typically take longer than the limit.
  */
-int gb_operation_request_send(struct gb_operation *operation,
-				gb_operation_callback callback,
-				gfp_t gfp)
+static unsigned int
+gb_operation_sync_spin_window(struct gb_connection *connection)
 {
-	struct gb_connection *connection = operation->connection;
-	struct gb_operation_msg_hdr *header;
-	unsigned int cycle;
-	int ret;
-
-	if (!callback)
-		return -EINVAL;
-	/*
-	 * Record the callback function, which is executed in
-	 * non-atomic (workqueue) context when the final result
-	 * of an operation has been set.
-	 */
-	operation->callback = callback;
+	unsigned int spin_max = READ_ONCE(connection->sync_spin_max_us);
+	unsigned int rtt = READ_ONCE(connection->sync_rtt.srtt_us);
 
-	/*
-	 * Assign the operation's id, and store it in the request header.
-	 * Zero is a reserved operation id.
-	 */
-	cycle = (unsigned int)atomic_inc_return(&connection->op_cycle);
-	operation->id = (u16)(cycle % U16_MAX + 1);
-	header = operation->request->header;
-	header->operation_id = cpu_to_le16(operation->id);
+	if (!spin_max)
+		return 0;
 
-	gb_operation_result_set(operation, -EINPROGRESS);
+	if (!rtt)
+		return spin_max;	/* No history yet */
 
-	/*
-	 * Get an extra reference on the operation. It'll be dropped when the
-	 * operation completes.
-	 */
-	gb_operation_get(operation);
-	ret = gb_operation_get_active(operation);
-	if (ret)
-		goto err_put;
+	if (rtt > spin_max)
+		return 0;
 
-	ret = gb_message_send(operation->request, gfp);
-	if (ret)
-		goto err_put_active;
+	return min(2 * rtt, spin_max);
+}
 
-	return 0;
+/*
+ * Busy-wait for up to spin_us microseconds for an operation to complete.
+ * Returns true if it did.
+ */
+static bool gb_operation_sync_spin(struct gb_operation *operation,
+					ktime_t start, unsigned int spin_us)
+{
+	while (!completion_done(&operation->completion)) {
+		if (need_resched() || signal_pending(current))
+			return false;
+		if (ktime_us_delta(ktime_get(), start) >= spin_us)
+			return false;
 
-err_put_active:
-	gb_operation_put_active(operation);
-err_put:
-	gb_operation_put(operation);
+		cpu_relax();
+	}
 
-	return ret;
+	return true;
 }
-EXPORT_SYMBOL_GPL(gb_operation_request_send);
 
 /*
  * Send a synchronous operation.  This function is expected to
  * block, returning only when the response has arrived, (or when an
  * error is detected.  The return value is the result of the
  * operation.
+ *
+ * The timeout is enforced by the host device's timeout wheel, like that of
+ * asynchronous operations.  A timeout of zero means none: the caller then
+ * waits until the response arrives or it is interrupted, as it always has.
+ *
+ * Short operations may be waited for by spinning for a while before
+ * sleeping; see gb_operation_sync_spin_window().
  */
 int gb_operation_request_send_sync_timeout(struct gb_operation *operation,
 						unsigned int timeout)
 {
+	struct gb_connection *connection = operation->connection;
 	int ret;
-	unsigned long timeout_jiffies;
+	unsigned int spin_us;
+	ktime_t start;
+
+	/* All we need to do on completion is wake up the waiter below. */
+	operation->flags |= GB_OPERATION_FLAG_ATOMIC_CALLBACK;
+
+	start = ktime_get();
 
 	ret = gb_operation_request_send(operation, gb_operation_sync_callback,
-					GFP_KERNEL);
+					timeout, GFP_KERNEL);
 	if (ret)
 		return ret;
 
-	if (timeout)
-		timeout_jiffies = msecs_to_jiffies(timeout);
-	else
-		timeout_jiffies = MAX_SCHEDULE_TIMEOUT;
+	spin_us = gb_operation_sync_spin_window(connection);
+	if (spin_us) {
+		atomic_inc(&connection->sync_spins);
+		if (gb_operation_sync_spin(operation, start, spin_us)) {
+			atomic_inc(&connection->sync_spin_hits);
+			goto out_complete;
+		}
+	}
 
-	ret = wait_for_completion_interruptible_timeout(&operation->completion,
-							timeout_jiffies);
+	/* Timeouts are taken care of by the host device's timeout wheel */
+	ret = wait_for_completion_interruptible(&operation->completion);
 	if (ret < 0) {
 		/* Cancel the operation if interrupted */
 		gb_operation_cancel(operation, -ECANCELED);
-	} else if (ret == 0) {
-		/* Cancel the operation if op timed out */
-		gb_operation_cancel(operation, -ETIMEDOUT);
+		goto out;
 	}
 
+	if (READ_ONCE(operation->errno) == -ETIMEDOUT)
+		goto out;
+
+out_complete:
+	gb_operation_rtt_sample(&connection->sync_rtt,
+				ktime_us_delta(ktime_get(), start));
+out:
 	return gb_operation_result(operation);
 }
 EXPORT_SYMBOL_GPL(gb_operation_request_send_sync_timeout);
@@ -803,10 +2081,8 @@ void greybus_message_sent(struct gb_host_device *hd,
 		gb_operation_put_active(operation);
 		gb_operation_put(operation);
 	} else if (status) {
-		if (gb_operation_result_set(operation, status)) {
-			queue_work(gb_operation_completion_wq,
-					&operation->work);
-		}
+		if (gb_operation_result_set(operation, status))
+			gb_operation_complete_outgoing(operation);
 	}
 }
 EXPORT_SYMBOL_GPL(greybus_message_sent);
@@ -816,37 +2092,49 @@ EXPORT_SYMBOL_GPL(greybus_message_sent);
  * response, so we assume it's a request.
  *
  * This is called in interrupt context, so just copy the incoming
- * data into the request buffer and handle the rest via workqueue.
+ * data into the request buffer (or take over the host driver's buffer
+ * if it lends it to us) and handle the rest via workqueue.
+ *
+ * Returns true if a lent buffer was taken over.
  */
-static void gb_connection_recv_request(struct gb_connection *connection,
+static bool gb_connection_recv_request(struct gb_connection *connection,
 				       u16 operation_id, u8 type,
-				       void *data, size_t size)
+				       void *data, size_t size, void *cookie)
 {
+	struct gb_connection_incoming *incoming;
 	struct gb_operation *operation;
 	int ret;
 
 	operation = gb_operation_create_incoming(connection, operation_id,
-						type, data, size);
+						type, data, size, cookie);
 	if (!operation) {
 		dev_err(&connection->hd->dev,
 			"%s: can't create incoming operation\n",
 			connection->name);
-		return;
+		return false;
 	}
 
 	ret = gb_operation_get_active(operation);
 	if (ret) {
 		gb_operation_put(operation);
-		return;
+		return cookie != NULL;
 	}
 	trace_gb_message_recv_request(operation->request);
 
 	/*
 	 * The initial reference to the operation will be dropped when the
-	 * request handler returns.
+	 * request handler returns.  The work of a lane only needs queueing
+	 * when its list was empty, as it is pending or running otherwise.
 	 */
-	if (gb_operation_result_set(operation, -EINPROGRESS))
-		queue_work(connection->wq, &operation->work);
+	if (gb_operation_result_set(operation, -EINPROGRESS)) {
+		incoming = gb_operation_incoming_lane(operation);
+		if (!incoming)
+			queue_work(connection->wq, &operation->work);
+		else if (llist_add(&operation->incoming_node, &incoming->list))
+			queue_work(connection->wq, &incoming->work);
+	}
+
+	return cookie != NULL;
 }
 
 /*
@@ -874,7 +2162,7 @@ static void gb_connection_recv_response(struct gb_connection *connection,
 	}
 
 	message = operation->response;
-	message_size = sizeof(*message->header) + message->payload_size;
+	message_size = gb_message_size(message);
 	if (!errno && size != message_size) {
 		dev_err(&connection->hd->dev,
 			"%s: malformed response 0x%02hhx received (%zu != %zu)\n",
@@ -890,8 +2178,19 @@ static void gb_connection_recv_response(struct gb_connection *connection,
 
 	/* The rest will be handled in work queue context */
 	if (gb_operation_result_set(operation, errno)) {
-		memcpy(message->header, data, size);
-		queue_work(gb_operation_completion_wq, &operation->work);
+		if (!errno && message->sg_size) {
+			size -= message->sg_size;
+			sg_pcopy_from_buffer(message->sg, message->sg_nents,
+						data + size, message->sg_size,
+						message->sg_skip);
+		}
+		/* The payload may live apart from the header */
+		memcpy(message->header, data, sizeof(*message->header));
+		if (size > sizeof(*message->header)) {
+			memcpy(message->payload, data + sizeof(*message->header),
+				size - sizeof(*message->header));
+		}
+		gb_operation_complete_outgoing(operation);
 	}
 
 	gb_operation_put(operation);
@@ -901,9 +2200,13 @@ static void gb_connection_recv_response(struct gb_connection *connection,
  * Handle data arriving on a connection.  As soon as we return the
  * supplied data buffer will be reused (so unless we do something
  * with, it's effectively dropped).
+ *
+ * If cookie is non-null the host driver offers to lend us its buffer.
+ * Returns true if we took it, in which case it will be handed back
+ * through the host driver's rx_buffer_release callback.
  */
-void gb_connection_recv(struct gb_connection *connection,
-				void *data, size_t size)
+bool gb_connection_recv(struct gb_connection *connection,
+				void *data, size_t size, void *cookie)
 {
 	struct gb_operation_msg_hdr header;
 	struct device *dev = &connection->hd->dev;
@@ -913,12 +2216,12 @@ void gb_connection_recv(struct gb_connection *connection,
 	if (connection->state != GB_CONNECTION_STATE_ENABLED) {
 		dev_warn(dev, "%s: dropping %zu received bytes\n",
 				connection->name, size);
-		return;
+		return false;
 	}
 
 	if (size < sizeof(header)) {
 		dev_err(dev, "%s: short message received\n", connection->name);
-		return;
+		return false;
 	}
 
 	/* Use memcpy as data may be unaligned */
@@ -929,16 +2232,18 @@ void gb_connection_recv(struct gb_connection *connection,
 			"%s: incomplete message 0x%04hx of type 0x%02hhx received (%zu < %zu)\n",
 			connection->name, le16_to_cpu(header.operation_id),
 			header.type, size, msg_size);
-		return;		/* XXX Should still complete operation */
+		return false;	/* XXX Should still complete operation */
 	}
 
 	operation_id = le16_to_cpu(header.operation_id);
-	if (header.type & GB_MESSAGE_TYPE_RESPONSE)
+	if (header.type & GB_MESSAGE_TYPE_RESPONSE) {
 		gb_connection_recv_response(connection, operation_id,
 						header.result, data, msg_size);
-	else
-		gb_connection_recv_request(connection, operation_id,
-						header.type, data, msg_size);
+		return false;
+	}
+
+	return gb_connection_recv_request(connection, operation_id,
+					header.type, data, msg_size, cookie);
 }
 
 /*
@@ -952,43 +2257,145 @@ void gb_operation_cancel(struct gb_operation *operation, int errno)
 
 	if (gb_operation_result_set(operation, errno)) {
 		gb_message_cancel(operation->request);
-		queue_work(gb_operation_completion_wq, &operation->work);
+		gb_operation_complete_outgoing(operation);
 	}
 	trace_gb_message_cancel_outgoing(operation->request);
 
 	atomic_inc(&operation->waiters);
-	wait_event(gb_operation_cancellation_queue,
+	wait_event(operation->connection->cancel_wq,
 			!gb_operation_is_active(operation));
 	atomic_dec(&operation->waiters);
 }
 EXPORT_SYMBOL_GPL(gb_operation_cancel);
 
-/*
- * Cancel an incoming operation synchronously. Called during connection tear
- * down.
- */
-void gb_operation_cancel_incoming(struct gb_operation *operation, int errno)
+static void __gb_operation_cancel_incoming(struct gb_operation *operation,
+						int errno)
 {
-	if (WARN_ON(!gb_operation_is_incoming(operation)))
-		return;
-
 	if (!gb_operation_is_unidirectional(operation)) {
 		/*
 		 * Make sure the request handler has submitted the response
-		 * before cancelling it.
+		 * before cancelling it.  Its lane may go through a number of
+		 * runs before getting to it, so wait for this request's
+		 * handler rather than for the work.
 		 */
-		flush_work(&operation->work);
+		wait_for_completion(&operation->completion);
 		if (!gb_operation_result_set(operation, errno))
 			gb_message_cancel(operation->response);
 	}
 	trace_gb_message_cancel_incoming(operation->response);
+}
+
+/*
+ * Cancel an incoming operation synchronously. Called during connection tear
+ * down.
+ */
+void gb_operation_cancel_incoming(struct gb_operation *operation, int errno)
+{
+	if (WARN_ON(!gb_operation_is_incoming(operation)))
+		return;
+
+	__gb_operation_cancel_incoming(operation, errno);
 
 	atomic_inc(&operation->waiters);
-	wait_event(gb_operation_cancellation_queue,
+	wait_event(operation->connection->cancel_wq,
 			!gb_operation_is_active(operation));
 	atomic_dec(&operation->waiters);
 }
 
+/*
+ * Cancel the requests of a batch of outgoing operations whose result has
+ * already been set, and complete the operations.
+ */
+static void gb_operation_cancel_batch(struct gb_connection *connection,
+					struct gb_operation **operations,
+					unsigned int count)
+{
+	struct gb_host_device *hd = connection->hd;
+	struct gb_message *messages[GB_HD_MESSAGE_BATCH_MAX];
+	unsigned int i;
+
+	if (hd->driver->message_cancel_batch) {
+		for (i = 0; i < count; i++)
+			messages[i] = operations[i]->request;
+		hd->driver->message_cancel_batch(hd, messages, count);
+	} else {
+		for (i = 0; i < count; i++)
+			gb_message_cancel(operations[i]->request);
+	}
+
+	for (i = 0; i < count; i++) {
+		trace_gb_message_cancel_outgoing(operations[i]->request);
+		gb_operation_complete_outgoing(operations[i]);
+		gb_operation_put(operations[i]);
+	}
+}
+
+static bool gb_connection_operations_idle(struct gb_connection *connection)
+{
+	unsigned long flags;
+	bool ret;
+
+	spin_lock_irqsave(&connection->lock, flags);
+	ret = list_empty(&connection->operations);
+	spin_unlock_irqrestore(&connection->lock, flags);
+
+	return ret;
+}
+
+/*
+ * Cancel all active operations of a connection and wait for them to go
+ * inactive.  Called during connection tear down, once no new operations
+ * can become active.
+ *
+ * The outgoing operations are all marked cancelled at once, and their
+ * requests are then cancelled in batches so that host drivers can kill
+ * them in parallel.  Rather than waiting for every operation in turn, we
+ * wait once for the last one to go inactive.
+ */
+void gb_operation_cancel_all(struct gb_connection *connection, int errno)
+{
+	struct gb_operation *batch[GB_HD_MESSAGE_BATCH_MAX];
+	struct gb_operation *operation;
+	struct gb_operation *next;
+	LIST_HEAD(outgoing);
+	LIST_HEAD(incoming);
+	unsigned int count;
+
+	spin_lock_irq(&connection->lock);
+	list_for_each_entry(operation, &connection->operations, links) {
+		if (gb_operation_is_incoming(operation))
+			list_add_tail(&operation->cancel_links, &incoming);
+		else if (gb_operation_result_set(operation, errno))
+			list_add_tail(&operation->cancel_links, &outgoing);
+		else
+			continue;	/* already being completed */
+
+		gb_operation_get(operation);
+	}
+	spin_unlock_irq(&connection->lock);
+
+	count = 0;
+	list_for_each_entry_safe(operation, next, &outgoing, cancel_links) {
+		list_del(&operation->cancel_links);
+		batch[count++] = operation;
+		if (count == ARRAY_SIZE(batch)) {
+			gb_operation_cancel_batch(connection, batch, count);
+			count = 0;
+		}
+	}
+	if (count)
+		gb_operation_cancel_batch(connection, batch, count);
+
+	list_for_each_entry_safe(operation, next, &incoming, cancel_links) {
+		list_del(&operation->cancel_links);
+		__gb_operation_cancel_incoming(operation, errno);
+		gb_operation_put(operation);
+	}
+
+	wait_event(connection->cancel_wq,
+			gb_connection_operations_idle(connection));
+}
+
 /**
  * gb_operation_sync: implement a "simple" synchronous gb operation.
  * @connection: the Greybus connection to send this to
@@ -997,7 +2404,8 @@ void gb_operation_cancel_incoming(struct gb_operation *operation, int errno)
  * @request_size: size of @request
  * @response: pointer to a memory buffer to copy the response to
  * @response_size: the size of @response.
- * @timeout: operation timeout in milliseconds
+ * @timeout: operation timeout in milliseconds, GB_OPERATION_TIMEOUT_ADAPTIVE,
+ *	or 0 to wait for the response for as long as it takes
  *
  * This function implements a simple synchronous Greybus operation.  It sends
  * the provided operation request and waits (sleeps) until the corresponding
@@ -1034,58 +2442,314 @@ int gb_operation_sync_timeout(struct gb_connection *connection, int type,
 		memcpy(operation->request->payload, request, request_size);
 
 	ret = gb_operation_request_send_sync_timeout(operation, timeout);
+	if (!ret && response_size) {
+		memcpy(response, operation->response->payload,
+		       response_size);
+	}
+
+	gb_operation_put(operation);
+
 	if (ret) {
 		dev_err(&connection->hd->dev,
 			"%s: synchronous operation of type 0x%02hhx failed: %d\n",
 			connection->name, type, ret);
-	} else {
-		if (response_size) {
-			memcpy(response, operation->response->payload,
-			       response_size);
-		}
 	}
 
-	gb_operation_put(operation);
-
 	return ret;
 }
 EXPORT_SYMBOL_GPL(gb_operation_sync_timeout);
 
-int __init gb_operation_init(void)
+/**
+ * gb_operation_sync_small: a synchronous gb operation in caller storage
+ * @small: storage for the operation
+ * @connection: the Greybus connection to send this to
+ * @type: the type of operation to send
+ * @request: pointer to a memory buffer to copy the request from
+ * @request_size: size of @request
+ * @response: pointer to a memory buffer to receive the response into
+ * @response_size: the size of @response.
+ * @timeout: operation timeout in milliseconds, GB_OPERATION_TIMEOUT_ADAPTIVE,
+ *	or 0 to wait for the response for as long as it takes
+ *
+ * Like gb_operation_sync_timeout(), for requests and responses of up to
+ * GB_OPERATION_SMALL_PAYLOAD_MAX bytes, but without allocating anything.
+ * The operation and its request message are built in @small, and the
+ * response payload is received straight into @response.
+ *
+ * The host device may DMA the request from @small, which must therefore be
+ * allocated with kmalloc() (or be part of a structure that is), and not
+ * live on the stack.  It may only be used for one operation at a time, and
+ * is free to be reused once this function returns.
+ *
+ * If there is an error, the response buffer is left alone.
+ */
+int gb_operation_sync_small(struct gb_operation_small *small,
+				struct gb_connection *connection, int type,
+				void *request, int request_size,
+				void *response, int response_size,
+				unsigned int timeout)
+{
+	struct gb_operation *operation = &small->operation;
+	struct gb_host_device *hd = connection->hd;
+	struct gb_message *message;
+	int ret;
+
+	if ((response_size && !response) ||
+	    (request_size && !request))
+		return -EINVAL;
+	if (request_size > GB_OPERATION_SMALL_PAYLOAD_MAX ||
+	    response_size > GB_OPERATION_SMALL_PAYLOAD_MAX)
+		return -EINVAL;
+
+	memset(operation, 0, sizeof(*operation));
+	operation->connection = connection;
+
+	message = &operation->request_message;
+	message->buffer = small->request;
+	message->operation = operation;
+	gb_operation_message_init(hd, message, 0, request_size, type);
+	if (request_size)
+		memcpy(message->payload, request, request_size);
+	operation->request = message;
+
+	message = &operation->response_message;
+	message->buffer = &small->response_header;
+	message->operation = operation;
+	gb_operation_message_init(hd, message, 0, response_size,
+					type | GB_MESSAGE_TYPE_RESPONSE);
+	message->payload = response_size ? response : NULL;
+	operation->response = message;
+
+	gb_operation_init_common(operation, type, GB_OPERATION_FLAG_EMBEDDED);
+
+	ret = gb_operation_request_send_sync_timeout(operation, timeout);
+
+	/*
+	 * Wait for the core to be done with the operation, which includes
+	 * receiving a response that raced with a cancellation.
+	 */
+	wait_event(connection->cancel_wq, kref_read(&operation->kref) == 1);
+
+	if (ret) {
+		dev_err(&hd->dev,
+			"%s: synchronous operation of type 0x%02hhx failed: %d\n",
+			connection->name, type, ret);
+	}
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(gb_operation_sync_small);
+
+static int gb_operation_pool_show(struct seq_file *s, void *unused)
+{
+	struct gb_operation_pool *pool = s->private;
+	unsigned int free = 0;
+	struct list_head *l;
+	u64 hits, misses;
+
+	spin_lock_irq(&pool->lock);
+	list_for_each(l, &pool->free)
+		free++;
+	hits = pool->hits;
+	misses = pool->misses;
+	spin_unlock_irq(&pool->lock);
+
+	seq_printf(s, "count: %u\n", pool->count);
+	seq_printf(s, "free: %u\n", free);
+	seq_printf(s, "request_size: %zu\n", pool->request_size);
+	seq_printf(s, "response_size: %zu\n", pool->response_size);
+	seq_printf(s, "hits: %llu\n", hits);
+	seq_printf(s, "misses: %llu\n", misses);
+
+	return 0;
+}
+
+static int gb_operation_pool_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, gb_operation_pool_show, inode->i_private);
+}
+
+static const struct file_operations gb_operation_pool_fops = {
+	.open		= gb_operation_pool_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static struct gb_operation *
+gb_operation_pool_alloc(struct gb_connection *connection,
+				struct gb_operation_pool *pool)
+{
+	struct gb_operation *operation;
+	size_t offset;
+
+	operation = gb_operation_alloc(pool->request_size,
+					pool->response_size, GFP_KERNEL);
+	if (!operation)
+		return NULL;
+	operation->connection = connection;
+	operation->pool = pool;
+
+	/*
+	 * The buffer layout is fixed for the lifetime of the pool and is
+	 * based on the largest payloads it serves.
+	 */
+	if (!gb_operation_message_alloc(operation, &operation->request_message,
+					0, GB_OPERATION_TYPE_INVALID,
+					pool->request_size, GFP_KERNEL))
+		goto err_cache;
+	operation->request = &operation->request_message;
+
+	offset = gb_operation_response_offset(pool->request_size);
+	if (!gb_operation_message_alloc(operation, &operation->response_message,
+					offset, GB_OPERATION_TYPE_INVALID,
+					pool->response_size, GFP_KERNEL))
+		goto err_request;
+	operation->response = &operation->response_message;
+
+	return operation;
+
+err_request:
+	gb_operation_message_free(operation->request);
+err_cache:
+	kmem_cache_free(operation->cache, operation);
+
+	return NULL;
+}
+
+/**
+ * gb_operation_pool_create() - preallocate outgoing operations for a connection
+ * @connection:		the connection the operations will be sent over
+ * @count:		number of operations to preallocate
+ * @request_size:	largest request payload the pool will serve
+ * @response_size:	largest response payload the pool will serve
+ *
+ * Create a pool of outgoing operations from which gb_operation_create()
+ * serves requests that fit within the given payload sizes, without any
+ * allocation.  Requests that are too big, or that are made while all
+ * pooled operations are in use, fall back to regular allocation.
+ *
+ * This is intended to be called from a protocol's connection_init
+ * callback.  The pool is destroyed by the core when the connection is
+ * torn down.
+ *
+ * Return: 0 on success, or a negative errno on failure.
+ */
+int gb_operation_pool_create(struct gb_connection *connection,
+				unsigned int count, size_t request_size,
+				size_t response_size)
 {
-	gb_message_cache = kmem_cache_create("gb_message_cache",
-				sizeof(struct gb_message), 0, 0, NULL);
-	if (!gb_message_cache)
+	struct gb_operation_pool *pool;
+	struct gb_operation *operation;
+	unsigned int i;
+
+	if (connection->op_pool)
+		return -EBUSY;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
 		return -ENOMEM;
 
-	gb_operation_cache = kmem_cache_create("gb_operation_cache",
-				sizeof(struct gb_operation), 0, 0, NULL);
-	if (!gb_operation_cache)
-		goto err_destroy_message_cache;
+	kref_init(&pool->kref);
+	spin_lock_init(&pool->lock);
+	INIT_LIST_HEAD(&pool->free);
+	pool->count = count;
+	pool->request_size = request_size;
+	pool->response_size = response_size;
+
+	for (i = 0; i < count; i++) {
+		operation = gb_operation_pool_alloc(connection, pool);
+		if (!operation)
+			goto err_free;
+		list_add(&operation->links, &pool->free);
+	}
+
+	pool->dentry = debugfs_create_file("operation_pool", S_IRUGO,
+						connection->debugfs_dentry,
+						pool, &gb_operation_pool_fops);
+	connection->op_pool = pool;
+
+	return 0;
+
+err_free:
+	while (!list_empty(&pool->free)) {
+		operation = list_first_entry(&pool->free, struct gb_operation,
+						links);
+		list_del(&operation->links);
+		gb_operation_free(operation);
+	}
+	kfree(pool);
+
+	return -ENOMEM;
+}
+EXPORT_SYMBOL_GPL(gb_operation_pool_create);
+
+/*
+ * Destroy a connection's operation pool, if any.  Operations still in
+ * use are freed rather than returned to the pool when released.
+ *
+ * Called by the core once the connection's protocol has been torn down.
+ */
+void gb_operation_pool_destroy(struct gb_connection *connection)
+{
+	struct gb_operation_pool *pool = connection->op_pool;
+	struct gb_operation *operation;
+	LIST_HEAD(free);
+
+	if (!pool)
+		return;
+
+	connection->op_pool = NULL;
+	debugfs_remove(pool->dentry);
+
+	spin_lock_irq(&pool->lock);
+	pool->dead = true;
+	list_splice_init(&pool->free, &free);
+	spin_unlock_irq(&pool->lock);
+
+	while (!list_empty(&free)) {
+		operation = list_first_entry(&free, struct gb_operation, links);
+		list_del(&operation->links);
+		gb_operation_free(operation);
+	}
+
+	kref_put(&pool->kref, gb_operation_pool_release);
+}
 
-	gb_operation_completion_wq = alloc_workqueue("greybus_completion",
-				0, 0);
-	if (!gb_operation_completion_wq)
-		goto err_destroy_operation_cache;
+int __init gb_operation_init(void)
+{
+	int i;
+
+	gb_operation_timeout_shift =
+		ilog2(msecs_to_jiffies(GB_OPERATION_TIMEOUT_RESOLUTION));
+
+	for (i = 0; i < ARRAY_SIZE(gb_operation_caches); i++) {
+		gb_operation_caches[i].cache = kmem_cache_create(
+					gb_operation_caches[i].name,
+					sizeof(struct gb_operation) +
+					gb_operation_caches[i].buffer_size,
+					0, 0, NULL);
+		if (!gb_operation_caches[i].cache)
+			goto err_destroy_operation_caches;
+	}
 
 	return 0;
 
-err_destroy_operation_cache:
-	kmem_cache_destroy(gb_operation_cache);
-	gb_operation_cache = NULL;
-err_destroy_message_cache:
-	kmem_cache_destroy(gb_message_cache);
-	gb_message_cache = NULL;
+err_destroy_operation_caches:
+	while (--i >= 0) {
+		kmem_cache_destroy(gb_operation_caches[i].cache);
+		gb_operation_caches[i].cache = NULL;
+	}
 
 	return -ENOMEM;
 }
 
 void gb_operation_exit(void)
 {
-	destroy_workqueue(gb_operation_completion_wq);
-	gb_operation_completion_wq = NULL;
-	kmem_cache_destroy(gb_operation_cache);
-	gb_operation_cache = NULL;
-	kmem_cache_destroy(gb_message_cache);
-	gb_message_cache = NULL;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(gb_operation_caches); i++) {
+		kmem_cache_destroy(gb_operation_caches[i].cache);
+		gb_operation_caches[i].cache = NULL;
+	}
 }
@@ -11,12 +11,28 @@
 #define __OPERATION_H
 
 #include <linux/completion.h>
+#include <linux/dma-direction.h>
 
 struct gb_operation;
+struct gb_operation_pool;
 
-/* The default amount of time a request is given to complete */
+/*
+ * The default amount of time a request is given to complete.  A timeout of
+ * zero means none, for synchronous operations too, which then wait until
+ * the response arrives or the caller is interrupted.
+ */
 #define GB_OPERATION_TIMEOUT_DEFAULT	1000	/* milliseconds */
 
+/*
+ * Timeout value asking for a timeout derived from the round-trip times
+ * observed for the type of the operation, see gb_connection_rtt_timeout().
+ */
+#define GB_OPERATION_TIMEOUT_ADAPTIVE	UINT_MAX
+
+/* Default bounds of adaptive timeouts */
+#define GB_OPERATION_TIMEOUT_FLOOR	50	/* milliseconds */
+#define GB_OPERATION_TIMEOUT_CEILING	GB_OPERATION_TIMEOUT_DEFAULT
+
 /*
  * No protocol may define an operation that has numeric value 0x00.
  * It is reserved as an explicitly invalid value.
@@ -50,6 +66,12 @@ enum gb_operation_result {
  * Protocol code should only examine the payload and payload_size fields, and
  * host-controller drivers may use the hcpriv field. All other fields are
  * intended to be private to the operations core code.
+ *
+ * A message may carry sg_size bytes of payload following payload_size in a
+ * scatterlist rather than the message buffer.  The data starts sg_skip
+ * bytes into the first of sg_nents entries.  Host-controller drivers are
+ * only ever handed such messages if they set the sg_tablesize of their
+ * host device, and must then send the list after the message buffer.
  */
 struct gb_message {
 	struct gb_operation		*operation;
@@ -58,13 +80,31 @@ struct gb_message {
 	void				*payload;
 	size_t				payload_size;
 
+	struct scatterlist		*sg;
+	unsigned int			sg_nents;
+	size_t				sg_skip;
+	size_t				sg_size;
+
 	void				*buffer;
 
 	void				*hcpriv;
 };
 
+/* Size of a message on the wire, including any scatterlist payload */
+static inline size_t gb_message_size(struct gb_message *message)
+{
+	return sizeof(*message->header) + message->payload_size +
+		message->sg_size;
+}
+
 #define GB_OPERATION_FLAG_INCOMING		BIT(0)
 #define GB_OPERATION_FLAG_UNIDIRECTIONAL	BIT(1)
+#define GB_OPERATION_FLAG_ATOMIC_CALLBACK	BIT(2)
+
+#define GB_OPERATION_FLAG_RX_BUFFER		BIT(3)
+#define GB_OPERATION_FLAG_EMBEDDED		BIT(4)
+
+#define GB_OPERATION_FLAG_USER_MASK	GB_OPERATION_FLAG_ATOMIC_CALLBACK
 
 /*
  * A Greybus operation is a remote procedure call performed over a
@@ -80,6 +120,8 @@ struct gb_message {
  * pointer; the operation type; the request message payload (and
  * size); and the response message payload (and size).  Note that a
  * message with a 0-byte payload has a null message payload pointer.
+ * The priority class of an outgoing operation, which is that of its
+ * connection by default, may also be changed before it is sent.
  *
  * In addition, every operation has a result, which is an errno
  * value.  Protocol handlers access the operation result using
@@ -93,18 +135,46 @@ struct gb_operation {
 
 	unsigned long		flags;
 	u8			type;
+	u8			priority;	/* enum gb_operation_priority */
 	u16			id;
 	int			errno;		/* Operation result */
 
 	struct work_struct	work;
+	struct llist_node	incoming_node;	/* connection->incoming */
 	gb_operation_callback	callback;
-	struct completion	completion;
+	struct completion	completion;	/* response, or handler done */
 
 	struct kref		kref;
 	atomic_t		waiters;
 
 	int			active;
 	struct list_head	links;		/* connection->operations */
+	struct hlist_node	hash_links;	/* connection->outgoing_operations */
+	struct list_head	cancel_links;	/* gb_operation_cancel_all() */
+
+	struct list_head	timeout_links;	/* hd->timeout_wheel */
+	unsigned long		deadline;	/* in jiffies */
+
+	struct list_head	window_links;	/* connection->window_queue */
+	bool			window_credit;
+	ktime_t			send_time;
+
+	struct gb_operation_pool *pool;		/* NULL unless preallocated */
+
+	void			*private;
+
+	/*
+	 * The message structures live in the operation, and so do the
+	 * message buffers for all but large payloads.  buffer_size is the
+	 * space available in buffers[], which depends on the cache the
+	 * operation was allocated from.
+	 */
+	struct gb_message	request_message;
+	struct gb_message	response_message;
+
+	struct kmem_cache	*cache;
+	size_t			buffer_size;
+	u8			buffers[0] __aligned(sizeof(u64));
 };
 
 static inline bool
@@ -119,25 +189,85 @@ gb_operation_is_unidirectional(struct gb_operation *operation)
 	return operation->flags & GB_OPERATION_FLAG_UNIDIRECTIONAL;
 }
 
-void gb_connection_recv(struct gb_connection *connection,
-					void *data, size_t size);
+/*
+ * The request buffer of an incoming operation with this flag set belongs
+ * to the host driver, and is handed back to it on release.
+ */
+static inline bool
+gb_operation_has_rx_buffer(struct gb_operation *operation)
+{
+	return operation->flags & GB_OPERATION_FLAG_RX_BUFFER;
+}
+
+/*
+ * An operation with this flag set lives in storage owned by its caller
+ * rather than in memory allocated by the core.
+ */
+static inline bool
+gb_operation_is_embedded(struct gb_operation *operation)
+{
+	return operation->flags & GB_OPERATION_FLAG_EMBEDDED;
+}
+
+/*
+ * The callback of an operation with this flag set is called directly from
+ * the context in which its result is set, which may be interrupt context,
+ * rather than from a workqueue.
+ */
+static inline bool
+gb_operation_has_atomic_callback(struct gb_operation *operation)
+{
+	return operation->flags & GB_OPERATION_FLAG_ATOMIC_CALLBACK;
+}
+
+bool gb_connection_recv(struct gb_connection *connection,
+				void *data, size_t size, void *cookie);
 
 int gb_operation_result(struct gb_operation *operation);
 
 size_t gb_operation_get_payload_size_max(struct gb_connection *connection);
-struct gb_operation *gb_operation_create(struct gb_connection *connection,
-					u8 type, size_t request_size,
-					size_t response_size,
-					gfp_t gfp);
+struct gb_operation *
+gb_operation_create_flags(struct gb_connection *connection,
+				u8 type, size_t request_size,
+				size_t response_size, unsigned long flags,
+				gfp_t gfp);
+
+static inline struct gb_operation *
+gb_operation_create(struct gb_connection *connection,
+				u8 type, size_t request_size,
+				size_t response_size, gfp_t gfp)
+{
+	return gb_operation_create_flags(connection, type, request_size,
+						response_size, 0, gfp);
+}
+
+struct gb_operation *
+gb_operation_create_sg(struct gb_connection *connection,
+				u8 type, size_t request_size,
+				size_t response_size, struct scatterlist *sg,
+				unsigned int sg_nents, size_t sg_skip,
+				size_t sg_size, enum dma_data_direction dir,
+				gfp_t gfp);
+
 void gb_operation_get(struct gb_operation *operation);
 void gb_operation_put(struct gb_operation *operation);
+int gb_operation_reinit(struct gb_operation *operation);
+
+int gb_operation_pool_create(struct gb_connection *connection,
+				unsigned int count, size_t request_size,
+				size_t response_size);
+void gb_operation_pool_destroy(struct gb_connection *connection);
 
 bool gb_operation_response_alloc(struct gb_operation *operation,
 					size_t response_size, gfp_t gfp);
 
 int gb_operation_request_send(struct gb_operation *operation,
 				gb_operation_callback callback,
-				gfp_t gfp);
+				unsigned int timeout, gfp_t gfp);
+int gb_operation_request_send_batch(struct gb_operation **operations,
+					unsigned int count,
+					gb_operation_callback callback,
+					unsigned int timeout, gfp_t gfp);
 int gb_operation_request_send_sync_timeout(struct gb_operation *operation,
 						unsigned int timeout);
 static inline int
@@ -149,6 +279,9 @@ gb_operation_request_send_sync(struct gb_operation *operation)
 
 void gb_operation_cancel(struct gb_operation *operation, int errno);
 void gb_operation_cancel_incoming(struct gb_operation *operation, int errno);
+void gb_operation_cancel_all(struct gb_connection *connection, int errno);
+
+void gb_operation_incoming_work(struct work_struct *work);
 
 void greybus_message_sent(struct gb_host_device *hd,
 				struct gb_message *message, int status);
@@ -167,6 +300,33 @@ static inline int gb_operation_sync(struct gb_connection *connection, int type,
 			GB_OPERATION_TIMEOUT_DEFAULT);
 }
 
+/*
+ * Storage for small synchronous operations, see gb_operation_sync_small().
+ * The request message is sent from it, so it must not live on the stack.
+ * Only the response header is kept here; the response payload goes
+ * straight to the caller's buffer.
+ */
+#define GB_OPERATION_SMALL_PAYLOAD_MAX	8
+
+struct gb_operation_small {
+	struct gb_operation	operation;
+	u8			request[sizeof(struct gb_operation_msg_hdr) +
+					GB_OPERATION_SMALL_PAYLOAD_MAX]
+				____cacheline_aligned;
+	struct gb_operation_msg_hdr response_header;
+};
+
+int gb_operation_sync_small(struct gb_operation_small *small,
+				struct gb_connection *connection, int type,
+				void *request, int request_size,
+				void *response, int response_size,
+				unsigned int timeout);
+
+void gb_operation_window_work(struct work_struct *work);
+
+void gb_operation_timeouts_init(struct gb_host_device *hd);
+void gb_operation_timeouts_exit(struct gb_host_device *hd);
+
 int gb_operation_init(void);
 void gb_operation_exit(void);
 
@@ -293,37 +293,114 @@ static int gb_power_supply_prop_descriptors_get(struct gb_power_supply *gbpsy)
 	return 0;
 }
 
-static int __gb_power_supply_property_update(struct gb_power_supply *gbpsy,
-					     enum power_supply_property psp)
+static void __gb_power_supply_property_update(struct gb_power_supply *gbpsy,
+					      struct gb_power_supply_prop *prop,
+					      u32 val)
 {
-	struct gb_connection *connection = get_conn_from_psy(gbpsy);
-	struct gb_power_supply_prop *prop;
-	struct gb_power_supply_get_property_request req;
-	struct gb_power_supply_get_property_response resp;
-	u32 val;
-	int ret;
-
-	prop = get_psy_prop(gbpsy, psp);
-	if (!prop)
-		return -EINVAL;
-	req.psy_id = gbpsy->id;
-	req.property = (u8)psp;
-
-	ret = gb_operation_sync(connection, GB_POWER_SUPPLY_TYPE_GET_PROPERTY,
-				&req, sizeof(req), &resp, sizeof(resp));
-	if (ret < 0)
-		return ret;
-
-	val = le32_to_cpu(resp.prop_val);
 	if (val == prop->val)
-		return 0;
+		return;
 
 	prop->previous_val = prop->val;
 	prop->val = val;
 
 	check_changed(gbpsy, prop);
+}
 
-	return 0;
+/* Tracks the get property operations of a refresh still outstanding */
+struct gb_power_supply_update {
+	atomic_t		pending;
+	struct completion	done;
+};
+
+/* Called in atomic context */
+static void gb_power_supply_update_callback(struct gb_operation *operation)
+{
+	struct gb_power_supply_update *update = operation->private;
+
+	if (atomic_dec_and_test(&update->pending))
+		complete(&update->done);
+}
+
+/*
+ * Fetch all properties at once, sending the get property requests as a
+ * single batch.
+ */
+static int gb_power_supply_properties_update(struct gb_power_supply *gbpsy)
+{
+	struct gb_connection *connection = get_conn_from_psy(gbpsy);
+	struct gb_power_supply_get_property_request *req;
+	struct gb_power_supply_get_property_response *resp;
+	struct gb_power_supply_update update;
+	struct gb_operation **operations;
+	int count = gbpsy->properties_count;
+	int sent = 0;
+	int ret = 0;
+	int i;
+
+	operations = kcalloc(count, sizeof(*operations), GFP_KERNEL);
+	if (!operations)
+		return -ENOMEM;
+
+	for (i = 0; i < count; i++) {
+		operations[i] = gb_operation_create_flags(connection,
+					GB_POWER_SUPPLY_TYPE_GET_PROPERTY,
+					sizeof(*req), sizeof(*resp),
+					GB_OPERATION_FLAG_ATOMIC_CALLBACK,
+					GFP_KERNEL);
+		if (!operations[i]) {
+			ret = -ENOMEM;
+			goto out_put_operations;
+		}
+
+		req = operations[i]->request->payload;
+		req->psy_id = gbpsy->id;
+		req->property = (u8)gbpsy->props[i].prop;
+		operations[i]->private = &update;
+	}
+
+	atomic_set(&update.pending, count);
+	init_completion(&update.done);
+
+	sent = gb_operation_request_send_batch(operations, count,
+					       gb_power_supply_update_callback,
+					       GB_OPERATION_TIMEOUT_DEFAULT,
+					       GFP_KERNEL);
+	if (sent < 0) {
+		ret = sent;
+		sent = 0;
+		goto out_put_operations;
+	}
+
+	/* Only wait for the callbacks of the operations actually sent */
+	if (atomic_sub_and_test(count - sent, &update.pending))
+		complete(&update.done);
+
+	/* Operations that time out complete with -ETIMEDOUT */
+	wait_for_completion(&update.done);
+
+	for (i = 0; i < sent; i++) {
+		ret = gb_operation_result(operations[i]);
+		if (ret)
+			break;
+
+		resp = operations[i]->response->payload;
+		__gb_power_supply_property_update(gbpsy, &gbpsy->props[i],
+						  le32_to_cpu(resp->prop_val));
+	}
+	if (!ret && sent < count)
+		ret = -EIO;
+
+out_put_operations:
+	if (ret) {
+		dev_err(&connection->bundle->dev,
+			"failed to update properties: %d\n", ret);
+	}
+
+	for (i = 0; i < count && operations[i]; i++)
+		gb_operation_put(operations[i]);
+	kfree(operations);
+
+	return ret;
 }
 
 static int __gb_power_supply_property_get(struct gb_power_supply *gbpsy,
@@ -387,8 +464,7 @@ static int _gb_power_supply_property_get(struct gb_power_supply *gbpsy,
 
 static int gb_power_supply_status_get(struct gb_power_supply *gbpsy)
 {
-	int ret = 0;
-	int i;
+	int ret;
 
 	/* check if cache is good enough */
 	if (gbpsy->last_update &&
@@ -396,13 +472,7 @@ static int gb_power_supply_status_get(struct gb_power_supply *gbpsy)
 				  msecs_to_jiffies(cache_time)))
 		return 0;
 
-	for (i = 0; i < gbpsy->properties_count; i++) {
-		ret = __gb_power_supply_property_update(gbpsy,
-							gbpsy->props[i].prop);
-		if (ret < 0)
-			break;
-	}
-
+	ret = gb_power_supply_properties_update(gbpsy);
 	if (ret == 0)
 		gbpsy->last_update = jiffies;
 
@@ -18,6 +18,17 @@ struct gb_operation;
 #define GB_PROTOCOL_SKIP_CONTROL_DISCONNECTED	BIT(1)	/* Don't sent disconnected requests */
 #define GB_PROTOCOL_SKIP_VERSION		BIT(3)	/* Don't send get_version() requests */
 
+/*
+ * How the incoming requests of a protocol need to be ordered.  Requests
+ * that don't need to be handled in order of arrival may be handled
+ * concurrently.
+ */
+enum gb_protocol_ordering {
+	GB_PROTOCOL_ORDERED		= 0,	/* all requests in order */
+	GB_PROTOCOL_ORDERED_PER_TYPE	= 1,	/* requests of a type in order */
+	GB_PROTOCOL_UNORDERED		= 2,	/* handlers are independent */
+};
+
 typedef int (*gb_connection_init_t)(struct gb_connection *);
 typedef void (*gb_connection_exit_t)(struct gb_connection *);
 typedef int (*gb_request_recv_t)(u8, struct gb_operation *);
@@ -33,6 +44,7 @@ struct gb_protocol {
 	u8			minor;
 	u8			count;
 	unsigned long		flags;
+	enum gb_protocol_ordering ordering;	/* of incoming requests */
 
 	struct list_head	links;		/* global list */
 
@@ -160,6 +160,7 @@ static int gb_raw_connection_init(struct gb_connection *connection)
 
 	raw->connection = connection;
 	connection->private = raw;
+	connection->priority = GB_OPERATION_PRIORITY_LOW;
 
 	INIT_LIST_HEAD(&raw->list);
 	mutex_init(&raw->list_lock);
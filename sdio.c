@@ -22,7 +22,6 @@ struct gb_sdio_host {
 	struct mmc_request	*mrq;
 	struct mutex		lock;	/* lock for this host */
 	size_t			data_max;
-	void			*xfer_buffer;
 	spinlock_t		xfer;	/* lock to cancel ongoing transfer */
 	bool			xfer_stop;
 	struct workqueue_struct	*mrq_workqueue;
@@ -243,85 +242,92 @@ static int _gb_sdio_send(struct gb_sdio_host *host, struct mmc_data *data,
 			 size_t len, u16 nblocks, off_t skip)
 {
 	struct gb_sdio_transfer_request *request;
-	struct gb_sdio_transfer_response response;
-	struct scatterlist *sg = data->sg;
-	unsigned int sg_len = data->sg_len;
-	size_t copied;
+	struct gb_sdio_transfer_response *response;
+	struct gb_operation *operation;
 	u16 send_blksz;
 	u16 send_blocks;
 	int ret;
 
 	WARN_ON(len > host->data_max);
 
-	request = host->xfer_buffer;
+	/* The data is sent straight from the request's scatterlist */
+	operation = gb_operation_create_sg(host->connection,
+					   GB_SDIO_TYPE_TRANSFER,
+					   sizeof(*request), sizeof(*response),
+					   data->sg, data->sg_len, skip, len,
+					   DMA_TO_DEVICE, GFP_KERNEL);
+	if (!operation)
+		return -ENOMEM;
+
+	request = operation->request->payload;
 	request->data_flags = (data->flags >> 8);
 	request->data_blocks = cpu_to_le16(nblocks);
 	request->data_blksz = cpu_to_le16(data->blksz);
 
-	copied = sg_pcopy_to_buffer(sg, sg_len, &request->data[0], len, skip);
-
-	if (copied != len)
-		return -EINVAL;
-
-	ret = gb_operation_sync(host->connection, GB_SDIO_TYPE_TRANSFER,
-				request, len + sizeof(*request),
-				&response, sizeof(response));
+	ret = gb_operation_request_send_sync(operation);
 	if (ret < 0)
-		return ret;
+		goto exit_operation_put;
 
-	send_blocks = le16_to_cpu(response.data_blocks);
-	send_blksz = le16_to_cpu(response.data_blksz);
+	response = operation->response->payload;
+	send_blocks = le16_to_cpu(response->data_blocks);
+	send_blksz = le16_to_cpu(response->data_blksz);
 
 	if (len != send_blksz * send_blocks) {
 		dev_err(mmc_dev(host->mmc), "send: size received: %zu != %d\n",
 			len, send_blksz * send_blocks);
-		return -EINVAL;
+		ret = -EINVAL;
 	}
 
+exit_operation_put:
+	gb_operation_put(operation);
+
 	return ret;
 }
 
 static int _gb_sdio_recv(struct gb_sdio_host *host, struct mmc_data *data,
 			 size_t len, u16 nblocks, off_t skip)
 {
-	struct gb_sdio_transfer_request request;
+	struct gb_sdio_transfer_request *request;
 	struct gb_sdio_transfer_response *response;
-	struct scatterlist *sg = data->sg;
-	unsigned int sg_len = data->sg_len;
-	size_t copied;
+	struct gb_operation *operation;
 	u16 recv_blksz;
 	u16 recv_blocks;
 	int ret;
 
 	WARN_ON(len > host->data_max);
 
-	request.data_flags = (data->flags >> 8);
-	request.data_blocks = cpu_to_le16(nblocks);
-	request.data_blksz = cpu_to_le16(data->blksz);
+	/* The data is received straight into the request's scatterlist */
+	operation = gb_operation_create_sg(host->connection,
+					   GB_SDIO_TYPE_TRANSFER,
+					   sizeof(*request), sizeof(*response),
+					   data->sg, data->sg_len, skip, len,
+					   DMA_FROM_DEVICE, GFP_KERNEL);
+	if (!operation)
+		return -ENOMEM;
 
-	response = host->xfer_buffer;
+	request = operation->request->payload;
+	request->data_flags = (data->flags >> 8);
+	request->data_blocks = cpu_to_le16(nblocks);
+	request->data_blksz = cpu_to_le16(data->blksz);
 
-	ret = gb_operation_sync(host->connection, GB_SDIO_TYPE_TRANSFER,
-				&request, sizeof(request), response, len +
-				sizeof(*response));
+	ret = gb_operation_request_send_sync(operation);
 	if (ret < 0)
-		return ret;
+		goto exit_operation_put;
 
+	response = operation->response->payload;
 	recv_blocks = le16_to_cpu(response->data_blocks);
 	recv_blksz = le16_to_cpu(response->data_blksz);
 
 	if (len != recv_blksz * recv_blocks) {
 		dev_err(mmc_dev(host->mmc), "recv: size received: %d != %zu\n",
 			recv_blksz * recv_blocks, len);
-		return -EINVAL;
+		ret = -EINVAL;
 	}
 
-	copied = sg_pcopy_from_buffer(sg, sg_len, &response->data[0], len,
-				      skip);
-	if (copied != len)
-		return -EINVAL;
+exit_operation_put:
+	gb_operation_put(operation);
 
-	return 0;
+	return ret;
 }
 
 static int gb_sdio_transfer(struct gb_sdio_host *host, struct mmc_data *data)
@@ -710,7 +716,6 @@ static int gb_sdio_connection_init(struct gb_connection *connection)
 {
 	struct mmc_host *mmc;
 	struct gb_sdio_host *host;
-	size_t max_buffer;
 	int ret = 0;
 
 	mmc = mmc_alloc_host(sizeof(*host), &connection->bundle->dev);
@@ -723,6 +728,7 @@ static int gb_sdio_connection_init(struct gb_connection *connection)
 
 	host->connection = connection;
 	connection->private = host;
+	connection->priority = GB_OPERATION_PRIORITY_LOW;
 
 	ret = gb_sdio_get_caps(host);
 	if (ret < 0)
@@ -736,19 +742,13 @@ static int gb_sdio_connection_init(struct gb_connection *connection)
 
 	mmc->max_req_size = mmc->max_blk_size * mmc->max_blk_count;
 
-	max_buffer = gb_operation_get_payload_size_max(host->connection);
-	host->xfer_buffer = kzalloc(max_buffer, GFP_KERNEL);
-	if (!host->xfer_buffer) {
-		ret = -ENOMEM;
-		goto free_mmc;
-	}
 	mutex_init(&host->lock);
 	spin_lock_init(&host->xfer);
 	host->mrq_workqueue = alloc_workqueue("mmc-%s", 0, 1,
 					      dev_name(&connection->bundle->dev));
 	if (!host->mrq_workqueue) {
 		ret = -ENOMEM;
-		goto free_buffer;
+		goto free_mmc;
 	}
 	INIT_WORK(&host->mrqwork, gb_sdio_mrq_work);
 
@@ -763,8 +763,6 @@ static int gb_sdio_connection_init(struct gb_connection *connection)
 
 free_work:
 	destroy_workqueue(host->mrq_workqueue);
-free_buffer:
-	kfree(host->xfer_buffer);
 free_mmc:
 	connection->private = NULL;
 	mmc_free_host(mmc);
@@ -789,7 +787,6 @@ static void gb_sdio_connection_exit(struct gb_connection *connection)
 	flush_workqueue(host->mrq_workqueue);
 	destroy_workqueue(host->mrq_workqueue);
 	mmc_remove_host(mmc);
-	kfree(host->xfer_buffer);
 	mmc_free_host(mmc);
 }
 
@@ -649,6 +649,7 @@ static int gb_svc_connection_init(struct gb_connection *connection)
 	svc->state = GB_SVC_STATE_RESET;
 	svc->connection = connection;
 	connection->private = svc;
+	connection->priority = GB_OPERATION_PRIORITY_HIGH;
 
 	hd->svc = svc;
 